@@ -1,11 +1,25 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_image.h"
@@ -22,13 +36,28 @@ const int gridSize = 32;
 const float scaling = 2.0f;
 const int viewRows = 12;
 const int viewColumns = 16;
-#define MAX_COLUMNS 96
-#define MAX_ROWS 48
 #define MAX_PATH 100
-#define MAX_MOBS 100
-#define MAX_ITEMS 100
+#define PATH_CACHE_SIZE 32 // FindPath results kept
+#define FOV_CACHE_SIZE 16 // fields of view kept
+#define MAX_PLANNER_CHANGES 256 // collision changes logged for the player's planner between steps
 #define MAX_ENEMIES 10
-#define MAX_ACTIONS 100
+#define MAX_ACTIONS 1024 // shared by the action queues of all sprites
+#define CLUSTER_SIZE 16
+#define MAX_ENTRANCE_WIDTH 6
+#define CHUNK_SIZE 16 // in cells
+#define MAX_CHUNKS 16 // texture budget, in chunks
+#define CHUNK_MARGIN 64 // in pixels around the camera, so chunks are baked before they scroll in
+#define MAX_WORKERS 8
+#define BUCKET_SIZE 8 // in cells, for radius queries over mobs
+#ifndef PROFILER
+#define PROFILER 1 // timing zones, build with -DPROFILER=0 to compile them out
+#endif
+#define PROFILE_RING_SIZE 4096 // events kept per zone and thread, a power of two
+#define MAX_SIM_TURNS 100 // player turns before a simulated encounter is called a draw
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO // log calls below are compiled out, -DLOG_MIN_LEVEL=LOG_DEBUG keeps them all
+#endif
+#define LOG_RING_SIZE 1024 // log records on their way to the log thread, a power of two
 
 const float moveSpeed = 100.0f / 32;
 const int targetAC = 12;
@@ -44,7 +73,8 @@ enum LayerIndex
     LAYER_MOBS,
     LAYER_ITEMS,
     LAYER_TOP,
-    LAYER_COLLISION
+    LAYER_COLLISION,
+    NB_LAYERS
 };
 
 enum SpriteIndex
@@ -59,6 +89,12 @@ enum SpriteIndex
     SPRITE_PLAYERMOVE2 = 45,
 };
 
+// handle to a sprite: the slot it lives in, in the low bits, and the generation of that slot,
+// which is bumped whenever the sprite is destroyed, so handles to dead sprites are told apart
+typedef Uint32 Entity;
+#define ENTITY_NONE 0
+#define ENTITY_SLOT_BITS 20
+
 typedef enum ActionType
 {
     ACTION_NONE,
@@ -72,7 +108,7 @@ typedef struct Action
     union 
     {
         SDL_Point to;
-        struct Sprite* target;
+        Entity target;
     } obj;
 } Action;
 
@@ -87,631 +123,4907 @@ enum GameState
 
 const int playerSprites[] = {SPRITE_PLAYERIDLE, SPRITE_PLAYERMOVE1, SPRITE_PLAYERMOVE2};
 
-typedef struct Sprite
-{
-    SDL_Point pos;
-    SDL_Point offset;
-    int spriteIndex;
-    float animIndex;
-    int hp;
-    int AC;
-} Sprite;
-
-Sprite player;
-Sprite mobs[MAX_MOBS];
-int nbMobs = 0;
-Sprite items[MAX_ITEMS];
-int nbItems = 0;
-bool isColliding[MAX_COLUMNS][MAX_ROWS] = {false};
+// sprites as a structure of arrays, dense in [0, count) so loops only touch the fields they use;
+// destroying one moves the last into its place, slots map handles to where a sprite is now
+typedef struct SpriteStore
+{
+    int count;
+    int capacity;
+    Entity* entity;
+    SDL_Point* pos;
+    SDL_Point* offset;
+    int* spriteIndex;
+    float* animIndex;
+    int* hp;
+    int* AC;
+    Action* currentAction;
+    float* actionProgress;
+    int* actionHead; // queued actions, indices in actionPool, -1 when empty
+    int* actionTail;
+    SDL_Point* prevDrawPos; // in pixels, where the sprite was drawn as the tick it last moved in started
+    int* prevDrawTick; // that tick, -1 if it never moved
+    int nbSlots;
+    int slotCapacity;
+    int* dense; // index of the sprite in each slot, -1 when free
+    Uint32* generation;
+    int* freeSlots;
+    int nbFreeSlots;
+} SpriteStore;
+
+// node of a sprite's action queue
+typedef struct ActionNode
+{
+    Action action;
+    int next;
+} ActionNode;
+
+SpriteStore sprites; // the player and the mobs
+SpriteStore items;
+Entity player = ENTITY_NONE;
+int mapWidth = 0;
+int mapHeight = 0;
+const Uint16* layerData[NB_LAYERS]; // mapWidth x mapHeight tiles per layer, row-major, inside the level image
+
+// collision bits packed 64 cells per word, row-major, and for every cell the moves out of it
+// that are not blocked (diagonals don't cut corners), as bits NW N NE E SE S SW W from bit 7 down
+typedef struct CollisionGrid
+{
+    int width;
+    int height;
+    int wordsPerRow;
+    Uint64* bits;
+    Uint8* moves;
+    Uint32 version; // bumped on every change
+} CollisionGrid;
+
+CollisionGrid collision; // everything that blocks movement, sprites included
+CollisionGrid terrain; // the level's collision layer alone
+const SDL_Point moveOffsets[8] = {{-1, -1}, {0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}};
+
+// binary level file, in native (little-endian) byte order:
+// the header, nbLayers flat mapWidth x mapHeight tile arrays, then nbSpawns spawns
+#define LEVEL_MAGIC 0x4C564C53 // "SLVL"
+#define LEVEL_VERSION 1
+
+typedef struct LevelHeader
+{
+    Uint32 magic;
+    Uint32 version;
+    Uint32 width;
+    Uint32 height;
+    Uint32 nbLayers;
+    Uint32 nbSpawns;
+} LevelHeader;
+
+// one non-empty tile of the mobs or items layer
+typedef struct LevelSpawn
+{
+    Uint16 x;
+    Uint16 y;
+    Uint16 layer;
+    Uint16 spriteIndex;
+} LevelSpawn;
+
+// a level image, mapped from its file or in memory
+typedef struct LevelData
+{
+    const LevelHeader* header;
+    const Uint16* layers[NB_LAYERS];
+    const LevelSpawn* spawns;
+    void* base;
+    size_t size;
+    bool isMapped;
+} LevelData;
+
+LevelData level;
+
+// notices when the level file is written: inotify on its directory on Linux, which also sees
+// editors that save by renaming over the file, polling its modification time elsewhere
+typedef struct LevelWatch
+{
+    int fd; // inotify instance, -1 when polling
+    char name[256]; // level file name within its directory
+    time_t mtime;
+    Uint32 lastPoll;
+} LevelWatch;
+
+LevelWatch levelWatch = {-1, "", 0, 0};
+const Uint32 levelPollPeriod = 500; // in ms
+
+// mobs by cell, for point lookups, and by coarse bucket, for radius queries
+typedef struct SpatialIndex
+{
+    int width;
+    int height;
+    int nbBucketsX;
+    int nbBucketsY;
+    int* cells; // slot of the mob at each cell, -1 for none
+    int* buckets; // slot of the first mob of each bucket, -1 for none
+    int* nextInBucket; // by slot
+    int nextCapacity;
+} SpatialIndex;
+
+SpatialIndex mobIndex;
+
+// sprite sheet quads culled against the view and drawn together, in as few calls as the renderer allows
+typedef struct SpriteBatch
+{
+    SDL_Texture* texture;
+    SDL_Rect view; // in pixels, quads outside of it are dropped
+    int count;
+    int capacity;
+    SDL_Rect* srcrects;
+    SDL_Rect* dstrects;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_Vertex* vertices; // 4 per quad
+    int* indices; // 6 per quad
+#endif
+} SpriteBatch;
+
+SpriteBatch spriteBatch;
+
+// what a rendered frame shows, besides sprites in motion; frames are only drawn when it changes
+typedef struct SceneState
+{
+    SDL_Rect camera;
+    SDL_Point cursor;
+    int cursorSpriteIndex;
+    int pathLength;
+    Uint32 collisionVersion; // sprites moved, spawned or died
+    int nbItems;
+} SceneState;
 SDL_Renderer* renderer = NULL;
 SDL_Texture* spriteSheetTexture = NULL;
-SDL_Texture* backgroundTexture = NULL;
-SDL_Texture* foregroundTexture = NULL;
-Sprite* combatEnemies[MAX_ENEMIES];
-int nbCombatEnemies = 0;
+// the sprite sheet decoded once, RGBA8888, to bake chunks on the CPU; NULL to bake with the renderer
+Uint32* sheetPixels = NULL;
+int sheetWidth = 0;
+int sheetHeight = 0;
+Uint32* bakeBuffer = NULL; // pixels of the chunks being baked
+int bakeBufferSize = 0;
 
-Action currentAction;
-Action actionQueue[MAX_ACTIONS];
-int actionHead = 0;
-int actionTail = 0;
-float actionProgress = 0.0f;
+// square piece of the baked background/foreground, only kept around the camera
+typedef struct Chunk
+{
+    SDL_Point pos; // in chunks
+    SDL_Texture* background;
+    SDL_Texture* foreground;
+    Uint32 lastUsed; // frame it was last needed, for LRU eviction
+    bool isLoaded;
+} Chunk;
 
-void SpriteInit(Sprite* sprite, int x, int y, int spriteIndex, bool collides)
+Chunk chunks[MAX_CHUNKS];
+Uint32 chunkFrame = 0;
+// per-cell A* state, only valid when generation matches the context's
+typedef struct PathNode
 {
-    sprite->pos.x = x;
-    sprite->pos.y = y;
-    sprite->offset.x = 0;
-    sprite->offset.y = -16;
-    sprite->spriteIndex = spriteIndex;
-    sprite->animIndex = 0;
-    // sprite->currentAction.tp = ACTION_NONE;
-    // sprite->actionHead = 0;
-    // sprite->actionTail = 0;
-    sprite->hp = 8;
-    sprite->AC = 13;
-    if(collides) isColliding[x][y] = true;
-}
+    float dFromStart;
+    int cameFrom;
+    Uint32 generation;
+    bool isVisited;
+} PathNode;
 
-int get_int_at_key(lua_State* L, const char* key)
+typedef struct HeapItem
 {
-    lua_pushstring(L, key);
-    int r = lua_gettable(L, -2);
-    assert(r == LUA_TNUMBER);
-    r = lua_tointeger(L, -1);
-    lua_pop(L, 1); // pop the result
-    return r;
-}
+    float priority;
+    int cell;
+} HeapItem;
 
-// int comp_str_at_key(lua_State* L, const char* key, const char* str)
-// {
-//     lua_pushstring(L, key);
-//     int r = lua_gettable(L, -2);
-//     assert(r == LUA_TSTRING);
-//     int res = (strcmp(lua_tostring(L, -1), str) == 0);
-//     lua_pop(L, 1); // pop the string
-//     return res;
-// }
+// search state kept between FindPath calls, so a search only touches the cells it reaches
+typedef struct PathContext
+{
+    int width;
+    int height;
+    PathNode* nodes;
+    HeapItem* heap;
+    int heapSize;
+    int heapCapacity;
+    Uint32 generation;
+} PathContext;
 
-void RenderSpriteIndex(SDL_Renderer* renderer, SDL_Texture* texture, int spriteIndex, const SDL_Rect* dstrect)
+typedef enum PathMode
 {
-    const int spriteSheetRows = 8;
-    const int spriteSheetColumns = 8;
-    if(spriteIndex > 0)
-    {
-        SDL_Rect srcrect = {
-            ((spriteIndex - 1) % spriteSheetColumns) * gridSize, 
-            ((spriteIndex - 1) / spriteSheetColumns) * gridSize, 
-            gridSize, 
-            gridSize
-        };
-        SDL_RenderCopy(renderer, texture, &srcrect, dstrect);
-    }
-}
+    PATH_ASTAR,
+    PATH_JPS,
+    PATH_HPA,
+} PathMode;
 
-bool LoadLualevel()
+// a FindPath result, valid while the collision grid stays at version
+typedef struct CachedPath
 {
-    lua_State* L = luaL_newstate();
-    if(luaL_dofile(L, levelFile) == LUA_OK)
-    {
-        int r = lua_gettop(L);
+    SDL_Point start;
+    SDL_Point end;
+    float (*h)(SDL_Point, SDL_Point);
+    Uint32 version;
+    Uint32 lastUsed;
+    int length;
+    SDL_Point path[MAX_PATH];
+} CachedPath;
 
-        int width = get_int_at_key(L, "width");
-        assert(width == MAX_COLUMNS);
-        int height = get_int_at_key(L, "height");
-        assert(height == MAX_ROWS);
+// D* Lite state of a cell, its cost to goal g and the one its successors give rhs
+typedef struct DStarNode
+{
+    float g;
+    float rhs;
+    float k1; // key the cell is queued with, when open
+    float k2;
+    bool isOpen;
+    Uint32 generation;
+} DStarNode;
 
-        lua_pushstring(L, "layers");
-        r = lua_gettable(L, -2);
-        assert(r == LUA_TTABLE);
+typedef struct DStarItem
+{
+    float k1;
+    float k2;
+    int cell;
+} DStarItem;
+
+// incremental planner for the player's queued moves, searching from the goal back to the start, 
+// so that the path can be repaired as the player walks and collision cells change
+typedef struct DStarPlanner
+{
+    int width;
+    int height;
+    DStarNode* nodes;
+    DStarItem* heap; // with lazy deletion
+    int heapSize;
+    int heapCapacity;
+    Uint32 generation;
+    SDL_Point start;
+    SDL_Point goal;
+    float km; // heuristic drift as the start moves, added to every key
+    bool isWatching; // following a path to goal, collision changes are logged
+    bool isPlanning; // nodes hold a search from goal
+    Uint32 version; // collision version the search state is up to date with
+    SDL_Point changes[MAX_PLANNER_CHANGES]; // cells changed since
+    int nbChanges; // may exceed MAX_PLANNER_CHANGES, then the search starts over
+} DStarPlanner;
 
-        int nb_layers = luaL_len(L, -1);
+// the last paths found, so that asking again while nothing moved is a lookup
+typedef struct PathCache
+{
+    CachedPath entries[PATH_CACHE_SIZE];
+    int nbEntries;
+    Uint32 clock; // bumped on every lookup
+    int hits;
+    int misses;
+} PathCache;
 
-        for(int i = 0; i < nb_layers; i++) 
-        {
-            r = lua_geti(L, -1, i + 1); // 1-based
-            assert(r == LUA_TTABLE);
+enum LinkDirection
+{
+    LINK_UP = 1,
+    LINK_RIGHT = 2,
+    LINK_DOWN = 4,
+    LINK_LEFT = 8,
+};
 
-            lua_pushstring(L, "data");
-            int data = lua_gettable(L, -2);
-            assert(r == LUA_TTABLE);
+// square block of the collision grid, with the distances inside the block between its entrances
+typedef struct Cluster
+{
+    SDL_Rect rect; // in cells
+    int entrances[4 * CLUSTER_SIZE]; // border cells with an edge to a neighbor cluster
+    int nbEntrances;
+    float* costs; // nbEntrances x nbEntrances, FLT_MAX when not connected inside the cluster
+    bool isDirty; // collisions changed inside, borders need to be rescanned
+    bool needsCosts; // entrances or collisions changed, costs need to be recomputed
+} Cluster;
 
-            switch (i)
-            {
-            case LAYER_GROUND:
-                backgroundTexture = SDL_CreateTexture(
-                    renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 
-                    MAX_COLUMNS * gridSize, MAX_ROWS * gridSize);
-            case LAYER_WALLS:
-            case LAYER_PROPS:
-                SDL_SetRenderTarget(renderer, backgroundTexture);
-                break;
-            case LAYER_TOP:
-                foregroundTexture = SDL_CreateTexture(
-                    renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 
-                    MAX_COLUMNS * gridSize, MAX_ROWS * gridSize);
-                SDL_SetTextureBlendMode(foregroundTexture, SDL_BLENDMODE_BLEND);
-                SDL_SetRenderTarget(renderer, foregroundTexture);
-                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-                SDL_RenderClear(renderer);
-                break;
-            default:
-                break;
-            }
+// abstract graph for hierarchical pathfinding (HPA*), rebuilt per cluster when collisions change
+typedef struct HpaGraph
+{
+    int width;
+    int height;
+    int nbClustersX;
+    int nbClustersY;
+    Cluster* clusters;
+    Uint8* links; // per cell, LinkDirection bits of the edges to neighbor clusters
+    bool isDirty;
+    PathContext local; // searches bounded to a cluster
+    PathContext abstract; // search over entrances, node ids are cells plus one for the goal
+} HpaGraph;
 
-            int data_len = luaL_len(L, -1);
-            for(int j = 1; j <= data_len; j++) // 1-based
-            {
-                r = lua_geti(L, -1, j); 
-                assert(r == LUA_TNUMBER);
-                r = lua_tointeger(L, -1);
+// distances from cells to the melee ring of a target, over the terrain alone so that sprites
+// moving around don't invalidate it; grown on demand by the queries
+typedef struct DistanceField
+{
+    PathContext ctx;
+    SDL_Point target;
+    Uint32 terrainVersion;
+    bool isValid;
+} DistanceField;
 
-                int x = (j - 1) % MAX_COLUMNS;
-                int y = (j - 1) / MAX_COLUMNS;
-                SDL_Rect dstrect = {x * gridSize, y * gridSize, gridSize, gridSize};
+// costs of the cells the player can reach within its move budget, from its cell, with the way
+// back to it; found once as its combat turn starts, then only read
+typedef struct RangeMap
+{
+    PathContext ctx;
+    SDL_Point origin;
+    Uint32 version; // of the collision grid it was found on
+    bool isValid;
+} RangeMap;
 
-                switch (i)
-                {
-                case LAYER_MOBS:
-                    if(r == SPRITE_PLAYERIDLE)
-                    {
-                        SpriteInit(&player, x, y, r, true);
-                    }
-                    else if(r == SPRITE_ORC)
-                    {
-                        assert(nbMobs < MAX_MOBS);
-                        SpriteInit(mobs + nbMobs, x, y, r, true);
-                        nbMobs++;
-                    }
-                    break;
-                case LAYER_ITEMS:
-                    if(r > 0)
-                    {
-                        assert(nbItems < MAX_ITEMS);
-                        SpriteInit(items + nbItems, x, y, r, false);
-                        nbItems++;
-                    }
-                    break;
-                case LAYER_COLLISION:
-                    isColliding[x][y] = (r > 0);
-                    break;
-                case LAYER_GROUND:
-                case LAYER_WALLS:
-                case LAYER_PROPS:
-                case LAYER_TOP:
-                    RenderSpriteIndex(renderer, spriteSheetTexture, r, &dstrect);
-                    break;
-                }
+// cells a viewer sees, as a bitset over the square of cells within radius around it; walls of
+// the terrain block the sight, sprites don't
+typedef struct FovMap
+{
+    SDL_Point origin;
+    int radius;
+    Uint32 version; // of the terrain grid it was cast on
+    Uint32 lastUsed;
+    Uint64* bits; // (2 * radius + 1)^2 bits, row-major
+    int nbWords;
+} FovMap;
 
-                lua_pop(L, 1); // pop the element
-            }
+// fields of view by viewer position, reused while the terrain is unchanged
+typedef struct FovCache
+{
+    FovMap entries[FOV_CACHE_SIZE];
+    int nbEntries;
+    Uint32 clock; // bumped on every lookup
+    int hits;
+    int misses;
+} FovCache;
 
-            lua_pop(L, 1); // pop the data
+// an enemy turn, planned for every enemy when the enemy phase starts
+typedef struct EnemyPlan
+{
+    SDL_Point start;
+    SDL_Point path[MAX_PATH];
+    int nbMoves; // already cut to enemyMaxMove
+    bool isInMelee;
+    bool isAttacking;
+    SDL_Rect reads; // cells whose moves the plan depends on
+} EnemyPlan;
 
-            lua_pop(L, 1); // pop the layer
-        }
+// fork-join workers, ParallelFor hands out the items of one job at a time
+typedef struct ThreadPool
+{
+    SDL_Thread* threads[MAX_WORKERS];
+    int nbThreads;
+    SDL_mutex* lock;
+    SDL_cond* wake; // a new job, or quit
+    SDL_cond* done; // the last worker finished the job
+    void (*job)(int item, int worker, void* data);
+    void* data;
+    int nbItems;
+    SDL_atomic_t nextItem;
+    Uint32 jobId;
+    int nbRunning;
+    bool quit;
+} ThreadPool;
 
-        lua_pop(L, 1); // pop layers
-        
-        lua_close(L);
-        SDL_SetRenderTarget(renderer, NULL);
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+PathContext pathContext;
+PathCache pathCache;
+DStarPlanner playerPlanner;
+PathContext workerContexts[MAX_WORKERS + 1]; // one per pool worker, the calling thread is worker 0
+HpaGraph hpa;
+DistanceField meleeField;
+RangeMap playerRange;
+FovCache fovCache;
+bool showRange = false; // draw the cells the player can reach during its combat turn
+PathMode pathMode = PATH_ASTAR;
+Entity combatEnemies[MAX_ENEMIES];
+EnemyPlan enemyPlans[MAX_ENEMIES];
+int nbCombatEnemies = 0;
+ThreadPool pool;
+int nbWorkers = -1; // -1 for one less than the number of CPUs
+
+// headless runs skip window, renderer and textures, and play scripted input
+bool headless = false;
+// number of ticks to run before printing timings, 0 to run until quit
+int benchTicks = 0;
+// number of combat encounters to simulate instead of playing, for balancing
+int simEncounters = 0;
+
+enum SimOutcome
+{
+    SIM_WIN,
+    SIM_LOSS,
+    SIM_DRAW,
+    NB_SIM_OUTCOMES
+};
+
+const char* outcomeNames[NB_SIM_OUTCOMES] = {"win", "loss", "draw"};
+
+// what a share of the simulated encounters came to, summed over the workers
+typedef struct SimStats
+{
+    Uint64 turns[NB_SIM_OUTCOMES][MAX_SIM_TURNS + 1]; // encounters by outcome and player turns played
+    Uint64 nbEnemies; // fought over all encounters
+    Uint64 nbSkipped; // no cell found to start a fight from
+} SimStats;
+
+CollisionGrid simCollision; // as the level was loaded, every simulated encounter starts from it
+int tick = 0; // game ticks run so far
+const float tickTime = 0.04f; // in seconds, the game advances by fixed ticks
+const int maxCatchUpTicks = 5; // ticks run at most per frame, past that the game slows down
+const int scriptPeriod = 50;
+// frame cap in frames per second, 0 for none; renderers without vsync default to 60
+int maxFps = -1;
+const int idleTimeout = 250; // in ms, longest wait for events while nothing changes
+
+typedef struct BenchSamples
+{
+    const char* name;
+    float* samples; // microseconds
+    int count;
+    int capacity;
+} BenchSamples;
+
+BenchSamples benchFrame = {"frame", NULL, 0, 0};
+BenchSamples benchFindPath = {"FindPath", NULL, 0, 0};
+BenchSamples benchUpdateSprite = {"UpdateSprites", NULL, 0, 0};
+BenchSamples benchEnemyPlan = {"EnemyPlan", NULL, 0, 0};
+
+// timing zones of the profiler
+typedef enum ProfileZone
+{
+    ZONE_FRAME,
+    ZONE_INPUT,
+    ZONE_TICK,
+    ZONE_FINDPATH,
+    ZONE_UPDATESPRITES,
+    ZONE_AGGRO,
+    ZONE_ENEMYPLAN,
+    ZONE_PLANENEMY,
+    ZONE_RELOAD,
+    ZONE_BAKE,
+    ZONE_BAKEBAND,
+    ZONE_BACKGROUND,
+    ZONE_SPRITES,
+    ZONE_FOREGROUND,
+    ZONE_PRESENT,
+    NB_ZONES
+} ProfileZone;
+
+const char* zoneNames[NB_ZONES] = {
+    "frame", "input", "tick", "FindPath", "UpdateSprites", "aggro", "EnemyPlan", "PlanEnemyJob",
+    "ReloadLevel", "BakeChunks", "BakeBand", "background", "sprites", "foreground", "present"
+};
+const char* profileFile = NULL; // Chrome trace written at exit, F12 writes profile.json otherwise
+
+ActionNode actionPool[MAX_ACTIONS];
+int actionPoolTop = 0; // nodes above were never used
+int freeAction = -1; // list of released nodes
+
+// pseudo-random generator for everything the game rolls, passed to whoever rolls, so that a
+// seed and the input played are enough to play a session again
+typedef struct Rng
+{
+    Uint64 state;
+} Rng;
+
+Uint64 seed = 1;
+
+// input recording, in native byte order: the header, then an entry for every tick the input
+// changed, plus one every checkpointPeriod ticks with a hash of the game state, and one at the end
+#define RECORD_MAGIC 0x43455253 // "SREC"
+#define RECORD_VERSION 1
+
+typedef struct RecordHeader
+{
+    Uint32 magic;
+    Uint32 version;
+    Uint64 seed;
+    char levelFile[256];
+} RecordHeader;
+
+typedef enum RecordType
+{
+    RECORD_INPUT,
+    RECORD_CHECKPOINT,
+    RECORD_END,
+} RecordType;
+
+typedef struct RecordEntry
+{
+    Uint32 tick;
+    Uint16 type;
+    Uint16 buttons;
+    Sint32 x; // cursor cell
+    Sint32 y;
+    Uint32 hash;
+} RecordEntry;
+
+typedef struct Recording
+{
+    FILE* file; // when recording
+    RecordHeader header;
+    RecordEntry* entries; // when replaying
+    int nbEntries;
+    int next;
+    int endTick;
+    SDL_Point cursor; // last input
+    Uint32 buttons;
+    bool hasInput;
+    int nbCheckpoints;
+    int nbMismatches;
+} Recording;
+
+const char* recordFile = NULL;
+const char* replayFile = NULL;
+Recording recording;
+const int checkpointPeriod = 50;
+
+void RngSeed(Rng* rng, Uint64 seed)
+{
+    rng->state = seed * 0x9E3779B97F4A7C15ull + 1; // never 0, xorshift would stay there
+    if(rng->state == 0) rng->state = 1;
 }
 
-void RenderSprite(SDL_Renderer* renderer, SDL_Texture* texture, Sprite* sprite, const SDL_Rect* camera)
+// xorshift64*
+Uint32 RngNext(Rng* rng)
 {
-    SDL_Rect dstrect = {
-        sprite->pos.x * gridSize + sprite->offset.x - camera->x, 
-        sprite->pos.y * gridSize + sprite->offset.y - camera->y, 
-        gridSize, 
-        gridSize
-    };
-    RenderSpriteIndex(renderer, texture, sprite->spriteIndex, &dstrect);        
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return (rng->state * 0x2545F4914F6CDD1Dull) >> 32;
 }
 
-int GetNeighbors(SDL_Point p, SDL_Point neighbors[8])
+// roll of a die with the given number of sides, from 1 to sides
+int RngRoll(Rng* rng, int sides)
 {
-    int nb_neighbors = 0;
-    if((p.x > 0) && (p.y > 0))
-        if(isColliding[p.x - 1][p.y] + isColliding[p.x - 1][p.y - 1] + isColliding[p.x][p.y - 1] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x - 1;
-            neighbors[nb_neighbors++].y = p.y - 1;
-        }
-    if(p.y > 0)
-        if(isColliding[p.x][p.y - 1] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x;
-            neighbors[nb_neighbors++].y = p.y - 1;
-        }
-    if((p.x < MAX_COLUMNS - 1) && (p.y > 0))
-        if(isColliding[p.x][p.y - 1] + isColliding[p.x + 1][p.y - 1] + isColliding[p.x + 1][p.y] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x + 1;
-            neighbors[nb_neighbors++].y = p.y - 1;
-        }
-    if(p.x < MAX_COLUMNS - 1)
-        if(isColliding[p.x + 1][p.y] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x + 1;
-            neighbors[nb_neighbors++].y = p.y;
-        }
-    if((p.x < MAX_COLUMNS - 1) && (p.y < MAX_ROWS - 1))
-        if(isColliding[p.x + 1][p.y] + isColliding[p.x + 1][p.y + 1] + isColliding[p.x][p.y + 1] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x + 1;
-            neighbors[nb_neighbors++].y = p.y + 1;
-        }
-    if(p.y < MAX_ROWS - 1)
-        if(isColliding[p.x][p.y + 1] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x;
-            neighbors[nb_neighbors++].y = p.y + 1;
-        }
-    if((p.x > 0) && (p.y < MAX_ROWS - 1))
-        if(isColliding[p.x][p.y + 1] + isColliding[p.x - 1][p.y + 1] + isColliding[p.x - 1][p.y] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x - 1;
-            neighbors[nb_neighbors++].y = p.y + 1;
-        }
-    if(p.x > 0)
-        if(isColliding[p.x - 1][p.y] == 0)
-        {
-            neighbors[nb_neighbors].x = p.x - 1;
-            neighbors[nb_neighbors++].y = p.y;
-        }
-    return nb_neighbors;
+    return RngNext(rng) % sides + 1;
 }
 
-// sift up element at position idx, based on priority
-int SiftUp(SDL_Point heap[], int idx, float priority[][MAX_ROWS])
+// game log: a record is a printf format and up to 4 int arguments, queued without locks or
+// formatting by whatever thread logs, then formatted and written out by a log thread, so that
+// logging never waits on a terminal or a pipe; records that find the ring full are dropped
+typedef enum LogLevel
 {
-    if(idx != 0) // otherwise, no need to sift up
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+    LOG_NONE
+} LogLevel;
+
+enum LogCategory
+{
+    LOG_COMBAT = 1,
+    LOG_AI = 2,
+    LOG_STATE = 4,
+    NB_LOG_CATEGORIES = 3
+};
+
+const char* logLevelNames[] = {"debug", "info", "warning", "error", "none"};
+const char* logCategoryNames[NB_LOG_CATEGORIES] = {"combat", "ai", "state"};
+
+typedef struct LogRecord
+{
+    SDL_atomic_t sequence; // its position in the log once written, plus 1; the position when free
+    const char* format;
+    int args[4];
+} LogRecord;
+
+typedef struct Logger
+{
+    LogRecord ring[LOG_RING_SIZE];
+    SDL_atomic_t tail; // position the next record is written at
+    SDL_atomic_t head; // position the log thread reads next
+    SDL_atomic_t nbDropped;
+    SDL_atomic_t quit;
+    SDL_atomic_t isPending; // set by the record that finds the log thread drained, which posts wake
+    SDL_sem* wake;
+    SDL_Thread* thread;
+    FILE* file;
+} Logger;
+
+Logger logger;
+LogLevel logLevel = LOG_INFO;
+int logCategories = LOG_COMBAT | LOG_AI | LOG_STATE;
+const char* logFile = NULL; // stdout otherwise
+
+#define LOG_ARGS(format, a, b, c, d, ...) format, a, b, c, d
+// log a message of a level and a category: a format and up to 4 int arguments for it;
+// the arguments are only evaluated when the message passes the filters
+#define GAME_LOG(level, category, ...) \
+    do \
+    { \
+        if(((level) >= LOG_MIN_LEVEL) && ((level) >= logLevel) && ((category) & logCategories)) \
+            LogWrite(LOG_ARGS(__VA_ARGS__, 0, 0, 0, 0, 0)); \
+    } while(0)
+
+int LogLevelFromName(const char* name)
+{
+    for(int i = 0; i <= LOG_NONE; i++)
     {
-        int parent_idx = (idx - 1) / 2;
-        if(priority[heap[parent_idx].x][heap[parent_idx].y] > priority[heap[idx].x][heap[idx].y]) // parent has larger f, so swap them
+        if(strcmp(name, logLevelNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// bounded multi-producer queue: a writer claims a position by moving the tail past it, fills
+// the slot and publishes it through its sequence; the log thread frees it the same way
+void LogWrite(const char* format, int a, int b, int c, int d)
+{
+    if(!logger.thread)
+    {
+        // no log thread to hand it to, write it in place
+        printf(format, a, b, c, d);
+        return;
+    }
+    Uint32 position = SDL_AtomicGet(&logger.tail);
+    LogRecord* record;
+    while(true)
+    {
+        record = logger.ring + (position & (LOG_RING_SIZE - 1));
+        int lag = (int)((Uint32)SDL_AtomicGet(&record->sequence) - position);
+        if((lag == 0) && SDL_AtomicCAS(&logger.tail, position, position + 1)) break;
+        if(lag < 0)
         {
-            SDL_Point tempNode = heap[parent_idx];
-            heap[parent_idx] = heap[idx];
-            heap[idx] = tempNode;
-            // try to sift up again from parent position
-            return SiftUp(heap, parent_idx, priority);
+            SDL_AtomicAdd(&logger.nbDropped, 1); // a full ring, the log thread is behind
+            return;
         }
+        position = SDL_AtomicGet(&logger.tail);
     }
-    return 0;
+    record->format = format;
+    record->args[0] = a;
+    record->args[1] = b;
+    record->args[2] = c;
+    record->args[3] = d;
+    SDL_AtomicSet(&record->sequence, position + 1);
+    if(SDL_AtomicCAS(&logger.isPending, 0, 1)) SDL_SemPost(logger.wake); // one wake-up per burst
 }
 
-int HeapInsert(SDL_Point heap[], int* heapSize, SDL_Point item, float priority[][MAX_ROWS])
+// write out the next record if it is published
+bool LogNext()
 {
-    (*heapSize)++; // increment heap size
-    heap[*heapSize - 1] = item; // append item at the end of the heap
-    return SiftUp(heap, *heapSize - 1, priority); // sift the new element up
+    Uint32 position = SDL_AtomicGet(&logger.head);
+    LogRecord* record = logger.ring + (position & (LOG_RING_SIZE - 1));
+    if((Uint32)SDL_AtomicGet(&record->sequence) != position + 1) return false;
+    fprintf(logger.file, record->format, record->args[0], record->args[1], record->args[2], record->args[3]);
+    SDL_AtomicSet(&record->sequence, position + LOG_RING_SIZE);
+    SDL_AtomicSet(&logger.head, position + 1);
+    return true;
 }
 
-int SiftDown(SDL_Point heap[], int idx, int* heapSize, float priority[][MAX_ROWS])
+int LogMain(void* data)
 {
-    int min_idx;
-    int left_child_idx = 2 * idx + 1;
-    int right_child_idx = 2 * idx + 2;
-    if (right_child_idx >= *heapSize)
-    {
-        if (left_child_idx >= *heapSize)
-            return idx;
-        else
-            min_idx = left_child_idx;
-    }
-    else
+    while(true)
     {
-        if (priority[heap[left_child_idx].x][heap[left_child_idx].y] <= priority[heap[right_child_idx].x][heap[right_child_idx].y])
-            min_idx = left_child_idx;
-        else
-            min_idx = right_child_idx;
+        SDL_AtomicSet(&logger.isPending, 0); // records published from here on wake the thread again
+        bool isQuitting = SDL_AtomicGet(&logger.quit); // before the last drain, nothing is left behind
+        while(LogNext()) {}
+        fflush(logger.file);
+        if(isQuitting) break;
+        SDL_SemWait(logger.wake);
     }
-    if (priority[heap[idx].x][heap[idx].y] > priority[heap[min_idx].x][heap[min_idx].y])
+    return 0;
+}
+
+bool LogInit()
+{
+    memset(&logger, 0, sizeof(logger));
+    for(int i = 0; i < LOG_RING_SIZE; i++)
     {
-        SDL_Point tmpNode = heap[min_idx];
-        heap[min_idx] = heap[idx];
-        heap[idx] = tmpNode;
-        return SiftDown(heap, min_idx, heapSize, priority);
+        SDL_AtomicSet(&logger.ring[i].sequence, i);
     }
-    else
-        return idx;
+    logger.file = logFile ? fopen(logFile, "w") : stdout;
+    if(!logger.file) return false;
+    logger.wake = SDL_CreateSemaphore(0);
+    if(logger.wake) logger.thread = SDL_CreateThread(LogMain, "log", NULL);
+    return true;
 }
 
-SDL_Point HeapPop(SDL_Point heap[], int* heapSize, float priority[][MAX_ROWS])
+// write out what is left and stop the log thread; later messages are written in place
+void LogFree()
 {
-    SDL_Point result = heap[0];
-    // move last element to front
-    heap[0] = heap[*heapSize - 1];
-    // decrement heap size
-    (*heapSize)--;
-    if(*heapSize > 0)
+    if(logger.thread)
     {
-        SiftDown(heap, 0, heapSize, priority);
+        SDL_AtomicSet(&logger.quit, 1);
+        SDL_SemPost(logger.wake);
+        SDL_WaitThread(logger.thread, NULL);
+        logger.thread = NULL;
     }
-    return result;
+    if(logger.wake) SDL_DestroySemaphore(logger.wake);
+    logger.wake = NULL;
+    if(logger.file && (logger.file != stdout)) fclose(logger.file);
+    logger.file = NULL;
+    int nbDropped = SDL_AtomicGet(&logger.nbDropped);
+    if(nbDropped > 0) printf("log: %d messages dropped\n", nbDropped);
 }
 
-float MeleeDistEstimate(SDL_Point a, SDL_Point b)
+Cluster* ClusterAt(SDL_Point p)
 {
-    int dx = abs(a.x - b.x);
-    if (dx > 0) dx--;
-    int dy = abs(a.y - b.y);
-    if (dy > 0) dy--;
-    return dx + dy;    
+    return hpa.clusters + (p.y / CLUSTER_SIZE) * hpa.nbClustersX + p.x / CLUSTER_SIZE;
 }
 
-float MoveCost(SDL_Point a, SDL_Point b)
+bool GridBit(const CollisionGrid* grid, int x, int y)
 {
-    int dx = abs(a.x - b.x);
-    int dy = abs(a.y - b.y);
-    return (dx > dy) ? (dx + 0.5f * dy) : (dy + 0.5f * dx);
+    return (grid->bits[y * grid->wordsPerRow + x / 64] >> (x % 64)) & 1;
 }
 
-void Reverse(SDL_Point x[], int length)
+bool IsColliding(int x, int y)
 {
-    for(int i = 0; i < length / 2; i++)
+    return GridBit(&collision, x, y);
+}
+
+// collision bits of the n <= 64 cells of row y starting at x, cell x in bit 0
+Uint64 RowBits(int x, int y, int n)
+{
+    const Uint64* row = collision.bits + y * collision.wordsPerRow;
+    int word = x / 64;
+    int shift = x % 64;
+    Uint64 bits = row[word] >> shift;
+    if((shift > 0) && (word + 1 < collision.wordsPerRow)) bits |= row[word + 1] << (64 - shift);
+    return (n < 64) ? bits & ((1ull << n) - 1) : bits;
+}
+
+Uint8 ComputeMoves(const CollisionGrid* grid, int x, int y)
+{
+    bool blocked[8];
+    for(int i = 0; i < 8; i++)
     {
-        SDL_Point tmp = x[length - 1 -i];
-        x[length - 1 -i] = x[i];
-        x[i] = tmp;
+        int nx = x + moveOffsets[i].x;
+        int ny = y + moveOffsets[i].y;
+        blocked[i] = (nx < 0) || (ny < 0) || (nx >= grid->width) || (ny >= grid->height) || GridBit(grid, nx, ny);
+    }
+    Uint8 moves = 0;
+    for(int i = 0; i < 8; i++)
+    {
+        // diagonals (even directions) also need both orthogonal cells next to them free
+        bool isFree = !blocked[i] && ((i % 2 == 1) || (!blocked[(i + 7) % 8] && !blocked[(i + 1) % 8]));
+        if(isFree) moves |= 0x80 >> i;
     }
+    return moves;
 }
 
-int FindPath(SDL_Point start, SDL_Point end, SDL_Point path[], float h(SDL_Point, SDL_Point))
+// empty grid for a width x height map
+void GridInit(CollisionGrid* grid, int width, int height)
 {
-    float dToGoal[MAX_COLUMNS][MAX_ROWS];
-    float dFromStart[MAX_COLUMNS][MAX_ROWS];
-    bool isVisited[MAX_COLUMNS][MAX_ROWS];
-    SDL_Point cameFrom[MAX_COLUMNS][MAX_ROWS];
-
-    // initialize
-    for(int x = 0; x < MAX_COLUMNS; x++)
-        for(int y = 0; y < MAX_ROWS; y++)
+    free(grid->bits);
+    free(grid->moves);
+    grid->width = width;
+    grid->height = height;
+    grid->wordsPerRow = (width + 63) / 64;
+    grid->bits = calloc(height * grid->wordsPerRow, sizeof(grid->bits[0]));
+    grid->moves = malloc(width * height * sizeof(grid->moves[0]));
+    assert(grid->bits && grid->moves);
+    for(int y = 0; y < height; y++)
+        for(int x = 0; x < width; x++)
         {
-            dFromStart[x][y] = FLT_MAX;
-            isVisited[x][y] = false;
+            grid->moves[y * width + x] = ComputeMoves(grid, x, y);
         }
+    grid->version++;
+}
 
-    // start with empty heap for the open set
-    SDL_Point heap[MAX_COLUMNS * MAX_ROWS];
-    int heapSize = 0;
-    // add start point
-    HeapInsert(heap, &heapSize, start, dToGoal);
-    dToGoal[start.x][start.y] = h(start, end);
-    dFromStart[start.x][start.y] = 0;
+// src over dst, both of the same size
+void GridCopy(CollisionGrid* dst, const CollisionGrid* src)
+{
+    assert((dst->width == src->width) && (dst->height == src->height));
+    memcpy(dst->bits, src->bits, src->height * src->wordsPerRow * sizeof(src->bits[0]));
+    memcpy(dst->moves, src->moves, src->width * src->height * sizeof(src->moves[0]));
+    dst->version++;
+}
 
-    while(heapSize > 0)
-    {
-        SDL_Point current = HeapPop(heap, &heapSize, dToGoal);
-        if(h(current, end) == 0.0f) // found path
+void GridFree(CollisionGrid* grid)
+{
+    free(grid->bits);
+    free(grid->moves);
+    Uint32 version = grid->version;
+    memset(grid, 0, sizeof(*grid));
+    grid->version = version + 1;
+}
+
+bool GridSet(CollisionGrid* grid, int x, int y, bool value)
+{
+    if(GridBit(grid, x, y) == value) return false;
+    grid->bits[y * grid->wordsPerRow + x / 64] ^= 1ull << (x % 64);
+    // the cell only takes part in the moves of the cells around it
+    for(int ny = SDL_max(0, y - 1); ny <= SDL_min(grid->height - 1, y + 1); ny++)
+        for(int nx = SDL_max(0, x - 1); nx <= SDL_min(grid->width - 1, x + 1); nx++)
         {
-            // backtrack to construct path
-            int length = 0;
-            while((start.x != current.x) || (start.y != current.y))
-            {
-                path[length] = current;
-                length++;
-                current = cameFrom[current.x][current.y];
-            }
-            assert(length < MAX_PATH);
-            Reverse(path, length);
-            return length;
+            grid->moves[ny * grid->width + nx] = ComputeMoves(grid, nx, ny);
+        }
+    grid->version++;
+    return true;
+}
+
+// every write to the collision grid goes through here, so derived data can follow
+void SetColliding(int x, int y, bool value)
+{
+    if(!GridSet(&collision, x, y, value)) return;
+    if(playerPlanner.isWatching)
+    {
+        SDL_Point p = {x, y};
+        if(playerPlanner.nbChanges < MAX_PLANNER_CHANGES) playerPlanner.changes[playerPlanner.nbChanges] = p;
+        playerPlanner.nbChanges++;
+    }
+    // clusters of another map are left to the next query to rebuild
+    if(hpa.clusters && (hpa.width == collision.width) && (hpa.height == collision.height))
+    {
+        SDL_Point p = {x, y};
+        ClusterAt(p)->isDirty = true;
+        hpa.isDirty = true;
+    }
+}
+
+void* GrowArray(void* array, int capacity, size_t size)
+{
+    array = realloc(array, capacity * size);
+    assert(array);
+    return array;
+}
+
+void StoreGrow(SpriteStore* store)
+{
+    store->capacity = store->capacity ? 2 * store->capacity : 64;
+    store->entity = GrowArray(store->entity, store->capacity, sizeof(store->entity[0]));
+    store->pos = GrowArray(store->pos, store->capacity, sizeof(store->pos[0]));
+    store->offset = GrowArray(store->offset, store->capacity, sizeof(store->offset[0]));
+    store->spriteIndex = GrowArray(store->spriteIndex, store->capacity, sizeof(store->spriteIndex[0]));
+    store->animIndex = GrowArray(store->animIndex, store->capacity, sizeof(store->animIndex[0]));
+    store->hp = GrowArray(store->hp, store->capacity, sizeof(store->hp[0]));
+    store->AC = GrowArray(store->AC, store->capacity, sizeof(store->AC[0]));
+    store->currentAction = GrowArray(store->currentAction, store->capacity, sizeof(store->currentAction[0]));
+    store->actionProgress = GrowArray(store->actionProgress, store->capacity, sizeof(store->actionProgress[0]));
+    store->actionHead = GrowArray(store->actionHead, store->capacity, sizeof(store->actionHead[0]));
+    store->actionTail = GrowArray(store->actionTail, store->capacity, sizeof(store->actionTail[0]));
+    store->prevDrawPos = GrowArray(store->prevDrawPos, store->capacity, sizeof(store->prevDrawPos[0]));
+    store->prevDrawTick = GrowArray(store->prevDrawTick, store->capacity, sizeof(store->prevDrawTick[0]));
+}
+
+int EntitySlot(Entity e)
+{
+    return e & ((1u << ENTITY_SLOT_BITS) - 1);
+}
+
+// index of e in the store's arrays, -1 if it was destroyed
+int EntityIndex(const SpriteStore* store, Entity e)
+{
+    int slot = EntitySlot(e);
+    if((e == ENTITY_NONE) || (slot >= store->nbSlots) || (store->generation[slot] != e >> ENTITY_SLOT_BITS)) return -1;
+    return store->dense[slot];
+}
+
+// slot of the last generation, the next one starts over; generation 0 is never handed out
+// so that no handle is ENTITY_NONE
+void FreeSlot(SpriteStore* store, int slot)
+{
+    store->generation[slot] = store->generation[slot] % ((1u << (32 - ENTITY_SLOT_BITS)) - 1) + 1;
+    store->dense[slot] = -1;
+    store->freeSlots[store->nbFreeSlots++] = slot;
+}
+
+Entity CreateEntity(SpriteStore* store)
+{
+    if(store->count == store->capacity) StoreGrow(store);
+    if(store->nbFreeSlots == 0)
+    {
+        assert(store->nbSlots < (1 << ENTITY_SLOT_BITS));
+        if(store->nbSlots == store->slotCapacity)
+        {
+            store->slotCapacity = store->slotCapacity ? 2 * store->slotCapacity : 64;
+            store->dense = GrowArray(store->dense, store->slotCapacity, sizeof(store->dense[0]));
+            store->generation = GrowArray(store->generation, store->slotCapacity, sizeof(store->generation[0]));
+            store->freeSlots = GrowArray(store->freeSlots, store->slotCapacity, sizeof(store->freeSlots[0]));
+        }
+        store->generation[store->nbSlots] = 1;
+        store->freeSlots[store->nbFreeSlots++] = store->nbSlots++;
+    }
+    int slot = store->freeSlots[--store->nbFreeSlots];
+    int i = store->count++;
+    store->dense[slot] = i;
+    store->entity[i] = (store->generation[slot] << ENTITY_SLOT_BITS) | slot;
+    return store->entity[i];
+}
+
+// the last sprite takes the place of the destroyed one
+void DestroyEntity(SpriteStore* store, Entity e)
+{
+    int i = EntityIndex(store, e);
+    assert(i >= 0);
+    int last = --store->count;
+    if(i != last)
+    {
+        store->entity[i] = store->entity[last];
+        store->pos[i] = store->pos[last];
+        store->offset[i] = store->offset[last];
+        store->spriteIndex[i] = store->spriteIndex[last];
+        store->animIndex[i] = store->animIndex[last];
+        store->hp[i] = store->hp[last];
+        store->AC[i] = store->AC[last];
+        store->currentAction[i] = store->currentAction[last];
+        store->actionProgress[i] = store->actionProgress[last];
+        store->actionHead[i] = store->actionHead[last];
+        store->actionTail[i] = store->actionTail[last];
+        store->prevDrawPos[i] = store->prevDrawPos[last];
+        store->prevDrawTick[i] = store->prevDrawTick[last];
+        store->dense[EntitySlot(store->entity[i])] = i;
+    }
+    FreeSlot(store, EntitySlot(e));
+}
+
+// destroy every sprite, handles to them stay invalid
+void StoreClear(SpriteStore* store)
+{
+    for(int i = 0; i < store->count; i++)
+    {
+        FreeSlot(store, EntitySlot(store->entity[i]));
+    }
+    store->count = 0;
+}
+
+void StoreFree(SpriteStore* store)
+{
+    free(store->entity);
+    free(store->pos);
+    free(store->offset);
+    free(store->spriteIndex);
+    free(store->animIndex);
+    free(store->hp);
+    free(store->AC);
+    free(store->currentAction);
+    free(store->actionProgress);
+    free(store->actionHead);
+    free(store->actionTail);
+    free(store->prevDrawPos);
+    free(store->prevDrawTick);
+    free(store->dense);
+    free(store->generation);
+    free(store->freeSlots);
+    memset(store, 0, sizeof(*store));
+}
+
+Entity SpriteInit(SpriteStore* store, int x, int y, int spriteIndex, bool collides)
+{
+    Entity e = CreateEntity(store);
+    int i = EntityIndex(store, e);
+    store->pos[i].x = x;
+    store->pos[i].y = y;
+    store->offset[i].x = 0;
+    store->offset[i].y = -16;
+    store->spriteIndex[i] = spriteIndex;
+    store->animIndex[i] = 0;
+    store->currentAction[i].tp = ACTION_NONE;
+    store->actionProgress[i] = 0.0f;
+    store->actionHead[i] = -1;
+    store->actionTail[i] = -1;
+    store->prevDrawTick[i] = -1;
+    store->hp[i] = 8;
+    store->AC[i] = 13;
+    if(collides) SetColliding(x, y, true);
+    return e;
+}
+
+// position of a live sprite of the sprites store
+SDL_Point SpritePos(Entity e)
+{
+    int i = EntityIndex(&sprites, e);
+    assert(i >= 0);
+    return sprites.pos[i];
+}
+
+// in pixels, where the sprite is drawn at the end of the last tick
+SDL_Point DrawPos(const SpriteStore* store, int i)
+{
+    SDL_Point p = {store->pos[i].x * gridSize + store->offset[i].x, store->pos[i].y * gridSize + store->offset[i].y};
+    return p;
+}
+
+// in pixels, where the sprite is drawn a fraction alpha of a tick past the last one: between the
+// last two ticks' positions, for sprites that moved in the last tick
+SDL_Point InterpolatedDrawPos(const SpriteStore* store, int i, float alpha)
+{
+    SDL_Point p = DrawPos(store, i);
+    if(store->prevDrawTick[i] != tick - 1) return p;
+    SDL_Point from = store->prevDrawPos[i];
+    p.x = from.x + (int)roundf((p.x - from.x) * alpha);
+    p.y = from.y + (int)roundf((p.y - from.y) * alpha);
+    return p;
+}
+
+int* BucketAt(SDL_Point p)
+{
+    return mobIndex.buckets + (p.y / BUCKET_SIZE) * mobIndex.nbBucketsX + p.x / BUCKET_SIZE;
+}
+
+void IndexInsert(Entity mob)
+{
+    int slot = EntitySlot(mob);
+    if(slot >= mobIndex.nextCapacity)
+    {
+        mobIndex.nextCapacity = sprites.slotCapacity;
+        mobIndex.nextInBucket = GrowArray(mobIndex.nextInBucket, mobIndex.nextCapacity, sizeof(mobIndex.nextInBucket[0]));
+    }
+    SDL_Point p = SpritePos(mob);
+    mobIndex.cells[p.y * mobIndex.width + p.x] = slot;
+    int* bucket = BucketAt(p);
+    mobIndex.nextInBucket[slot] = *bucket;
+    *bucket = slot;
+}
+
+void IndexRemove(Entity mob)
+{
+    int slot = EntitySlot(mob);
+    SDL_Point p = SpritePos(mob);
+    if(mobIndex.cells[p.y * mobIndex.width + p.x] == slot) mobIndex.cells[p.y * mobIndex.width + p.x] = -1;
+    int* link = BucketAt(p);
+    while(*link != slot)
+    {
+        assert(*link >= 0);
+        link = mobIndex.nextInBucket + *link;
+    }
+    *link = mobIndex.nextInBucket[slot];
+}
+
+// index every mob, for a map of width x height cells
+void IndexBuild(int width, int height)
+{
+    if((mobIndex.width != width) || (mobIndex.height != height))
+    {
+        free(mobIndex.cells);
+        free(mobIndex.buckets);
+        mobIndex.width = width;
+        mobIndex.height = height;
+        mobIndex.nbBucketsX = (width + BUCKET_SIZE - 1) / BUCKET_SIZE;
+        mobIndex.nbBucketsY = (height + BUCKET_SIZE - 1) / BUCKET_SIZE;
+        mobIndex.cells = malloc(width * height * sizeof(mobIndex.cells[0]));
+        mobIndex.buckets = malloc(mobIndex.nbBucketsX * mobIndex.nbBucketsY * sizeof(mobIndex.buckets[0]));
+        assert(mobIndex.cells && mobIndex.buckets);
+    }
+    memset(mobIndex.cells, 0xFF, width * height * sizeof(mobIndex.cells[0]));
+    memset(mobIndex.buckets, 0xFF, mobIndex.nbBucketsX * mobIndex.nbBucketsY * sizeof(mobIndex.buckets[0]));
+    for(int i = 0; i < sprites.count; i++)
+    {
+        if(sprites.entity[i] != player) IndexInsert(sprites.entity[i]);
+    }
+}
+
+void IndexFree()
+{
+    free(mobIndex.cells);
+    free(mobIndex.buckets);
+    free(mobIndex.nextInBucket);
+    memset(&mobIndex, 0, sizeof(mobIndex));
+}
+
+bool FovIsVisible(const FovMap* fov, SDL_Point p)
+{
+    int x = p.x - fov->origin.x + fov->radius;
+    int y = p.y - fov->origin.y + fov->radius;
+    int size = 2 * fov->radius + 1;
+    if((x < 0) || (y < 0) || (x >= size) || (y >= size)) return false;
+    int bit = y * size + x;
+    return (fov->bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+void FovSetVisible(FovMap* fov, int x, int y)
+{
+    int size = 2 * fov->radius + 1;
+    int bit = (y - fov->origin.y + fov->radius) * size + (x - fov->origin.x + fov->radius);
+    fov->bits[bit / 64] |= 1ull << (bit % 64);
+}
+
+// recursive shadowcasting of one octant, rows from row out to the radius, between two slopes;
+// (xx, xy, yx, yy) maps the octant's (column, row) onto the map
+void FovCastOctant(FovMap* fov, int row, float startSlope, float endSlope, int xx, int xy, int yx, int yy)
+{
+    if(startSlope < endSlope) return;
+    int radius = fov->radius;
+    float nextStartSlope = startSlope;
+    for(int j = row; j <= radius; j++)
+    {
+        bool isBlocked = false;
+        for(int dx = -j, dy = -j; dx <= 0; dx++)
+        {
+            float leftSlope = (dx - 0.5f) / (dy + 0.5f);
+            float rightSlope = (dx + 0.5f) / (dy - 0.5f);
+            if(startSlope < rightSlope) continue;
+            if(endSlope > leftSlope) break;
+            int x = fov->origin.x + dx * xx + dy * xy;
+            int y = fov->origin.y + dx * yx + dy * yy;
+            bool isInMap = (x >= 0) && (y >= 0) && (x < terrain.width) && (y < terrain.height);
+            if(isInMap && (dx * dx + dy * dy <= radius * radius)) FovSetVisible(fov, x, y);
+            bool isOpaque = !isInMap || GridBit(&terrain, x, y);
+            if(isBlocked)
+            {
+                if(isOpaque)
+                {
+                    nextStartSlope = rightSlope;
+                }
+                else
+                {
+                    isBlocked = false;
+                    startSlope = nextStartSlope;
+                }
+            }
+            else if(isOpaque && (j < radius))
+            {
+                // the cell casts a shadow, scan what it leaves lit past it
+                isBlocked = true;
+                FovCastOctant(fov, j + 1, startSlope, leftSlope, xx, xy, yx, yy);
+                nextStartSlope = rightSlope;
+            }
+        }
+        if(isBlocked) break;
+    }
+}
+
+// cells seen from origin within radius, walls stopping the sight but being seen themselves
+void FovCompute(FovMap* fov, SDL_Point origin, int radius)
+{
+    static const int octants[8][4] = {
+        {1, 0, 0, 1}, {0, 1, 1, 0}, {0, -1, 1, 0}, {-1, 0, 0, 1},
+        {-1, 0, 0, -1}, {0, -1, -1, 0}, {0, 1, -1, 0}, {1, 0, 0, -1}
+    };
+    int size = 2 * radius + 1;
+    int nbWords = (size * size + 63) / 64;
+    if(nbWords > fov->nbWords)
+    {
+        fov->nbWords = nbWords;
+        fov->bits = GrowArray(fov->bits, nbWords, sizeof(fov->bits[0]));
+    }
+    memset(fov->bits, 0, nbWords * sizeof(fov->bits[0]));
+    fov->origin = origin;
+    fov->radius = radius;
+    fov->version = terrain.version;
+    FovSetVisible(fov, origin.x, origin.y);
+    for(int i = 0; i < 8; i++)
+    {
+        FovCastOctant(fov, 1, 1.0f, 0.0f, octants[i][0], octants[i][1], octants[i][2], octants[i][3]);
+    }
+}
+
+// what a viewer at origin sees, from the cache while the terrain is unchanged
+const FovMap* GetFov(FovCache* cache, SDL_Point origin, int radius)
+{
+    cache->clock++;
+    FovMap* victim = NULL;
+    for(int i = 0; i < cache->nbEntries; i++)
+    {
+        FovMap* entry = cache->entries + i;
+        if((entry->version == terrain.version) && (entry->radius == radius) &&
+            (entry->origin.x == origin.x) && (entry->origin.y == origin.y))
+        {
+            entry->lastUsed = cache->clock;
+            cache->hits++;
+            return entry;
+        }
+        if(!victim || (entry->lastUsed < victim->lastUsed)) victim = entry;
+    }
+    if(cache->nbEntries < FOV_CACHE_SIZE) victim = cache->entries + cache->nbEntries++;
+    FovCompute(victim, origin, radius);
+    victim->lastUsed = cache->clock;
+    cache->misses++;
+    return victim;
+}
+
+void FovCacheFree(FovCache* cache)
+{
+    for(int i = 0; i < cache->nbEntries; i++)
+    {
+        free(cache->entries[i].bits);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+// the first maxFound mobs, in store order, within radius cells of center and seen in fov if not NULL;
+// returns how many were found
+int QueryMobs(SDL_Point center, int radius, const FovMap* fov, Entity found[], int maxFound)
+{
+    int order[maxFound > 0 ? maxFound : 1]; // store index of each found mob
+    int nbFound = 0;
+    int bx0 = SDL_max(0, (center.x - radius) / BUCKET_SIZE);
+    int by0 = SDL_max(0, (center.y - radius) / BUCKET_SIZE);
+    int bx1 = SDL_min(mobIndex.nbBucketsX - 1, (center.x + radius) / BUCKET_SIZE);
+    int by1 = SDL_min(mobIndex.nbBucketsY - 1, (center.y + radius) / BUCKET_SIZE);
+    for(int by = by0; by <= by1; by++)
+        for(int bx = bx0; bx <= bx1; bx++)
+        {
+            for(int slot = mobIndex.buckets[by * mobIndex.nbBucketsX + bx]; slot >= 0; slot = mobIndex.nextInBucket[slot])
+            {
+                int mob = sprites.dense[slot];
+                int dx = sprites.pos[mob].x - center.x;
+                int dy = sprites.pos[mob].y - center.y;
+                if(dx * dx + dy * dy > radius * radius) continue;
+                if(fov && !FovIsVisible(fov, sprites.pos[mob])) continue;
+                if((nbFound == maxFound) && ((maxFound == 0) || (order[maxFound - 1] < mob))) continue;
+                // insertion sort, there are only a few
+                int i = (nbFound < maxFound) ? nbFound++ : maxFound - 1;
+                for(; (i > 0) && (order[i - 1] > mob); i--)
+                {
+                    order[i] = order[i - 1];
+                    found[i] = found[i - 1];
+                }
+                order[i] = mob;
+                found[i] = sprites.entity[mob];
+            }
+        }
+    return nbFound;
+}
+
+// move a sprite to a neighboring cell, keeping collision and the mob index up to date
+void MoveSprite(Entity sprite, SDL_Point to)
+{
+    int i = EntityIndex(&sprites, sprite);
+    if(sprite != player) IndexRemove(sprite);
+    SetColliding(sprites.pos[i].x, sprites.pos[i].y, GridBit(&terrain, sprites.pos[i].x, sprites.pos[i].y));
+    sprites.pos[i] = to;
+    SetColliding(sprites.pos[i].x, sprites.pos[i].y, true);
+    if(sprite != player) IndexInsert(sprite);
+}
+
+int get_int_at_key(lua_State* L, const char* key)
+{
+    lua_pushstring(L, key);
+    int r = lua_gettable(L, -2);
+    assert(r == LUA_TNUMBER);
+    r = lua_tointeger(L, -1);
+    lua_pop(L, 1); // pop the result
+    return r;
+}
+
+// int comp_str_at_key(lua_State* L, const char* key, const char* str)
+// {
+//     lua_pushstring(L, key);
+//     int r = lua_gettable(L, -2);
+//     assert(r == LUA_TSTRING);
+//     int res = (strcmp(lua_tostring(L, -1), str) == 0);
+//     lua_pop(L, 1); // pop the string
+//     return res;
+// }
+
+void BenchRecord(BenchSamples* bench, Uint64 start)
+{
+    if(benchTicks == 0) return;
+    float us = (SDL_GetPerformanceCounter() - start) * 1000000.0f / SDL_GetPerformanceFrequency();
+    if(bench->count == bench->capacity)
+    {
+        bench->capacity = bench->capacity ? 2 * bench->capacity : 1024;
+        bench->samples = realloc(bench->samples, bench->capacity * sizeof(bench->samples[0]));
+        assert(bench->samples);
+    }
+    bench->samples[bench->count++] = us;
+}
+
+int CompareFloats(const void* a, const void* b)
+{
+    float fa = *(const float*)a;
+    float fb = *(const float*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+void BenchReport(BenchSamples* bench)
+{
+    if(bench->count == 0)
+    {
+        printf("%-14s n=0\n", bench->name);
+        return;
+    }
+    double sum = 0.0;
+    for(int i = 0; i < bench->count; i++)
+    {
+        sum += bench->samples[i];
+    }
+    qsort(bench->samples, bench->count, sizeof(bench->samples[0]), CompareFloats);
+    printf("%-14s n=%-8d mean=%8.2fus p50=%8.2fus p99=%8.2fus max=%8.2fus\n",
+        bench->name, bench->count, sum / bench->count,
+        bench->samples[bench->count / 2],
+        bench->samples[(int)(bench->count * 0.99f)],
+        bench->samples[bench->count - 1]);
+    free(bench->samples);
+    bench->samples = NULL;
+    bench->count = bench->capacity = 0;
+}
+
+#if PROFILER
+// the last events of a zone on a thread, written by that thread only, read by the main thread
+// while the workers wait for a job
+typedef struct ProfileRing
+{
+    Uint64 starts[PROFILE_RING_SIZE];
+    Uint64 ends[PROFILE_RING_SIZE];
+    Uint32 count; // events recorded so far, the ring holds the last PROFILE_RING_SIZE of them
+} ProfileRing;
+
+ProfileRing* profileRings[MAX_WORKERS + 1][NB_ZONES]; // allocated on the first event of a zone on a thread
+_Thread_local int profileThread = 0; // worker running on this thread, 0 for the main thread
+
+#define PROFILE_BEGIN(zone) Uint64 zone##Start = SDL_GetPerformanceCounter()
+#define PROFILE_END(zone) ProfileRecord(zone, zone##Start)
+#define PROFILE_THREAD(worker) profileThread = (worker)
+
+void ProfileRecord(int zone, Uint64 start)
+{
+    ProfileRing* ring = profileRings[profileThread][zone];
+    if(!ring)
+    {
+        ring = calloc(1, sizeof(*ring));
+        assert(ring);
+        profileRings[profileThread][zone] = ring;
+    }
+    Uint32 i = ring->count++ & (PROFILE_RING_SIZE - 1);
+    ring->starts[i] = start;
+    ring->ends[i] = SDL_GetPerformanceCounter();
+}
+
+// timings of every zone over the events the rings still hold, all threads together
+void ProfileReport()
+{
+    for(int zone = 0; zone < NB_ZONES; zone++)
+    {
+        BenchSamples samples = {zoneNames[zone], NULL, 0, 0};
+        for(int thread = 0; thread <= MAX_WORKERS; thread++)
+        {
+            const ProfileRing* ring = profileRings[thread][zone];
+            if(ring) samples.capacity += SDL_min(ring->count, PROFILE_RING_SIZE);
+        }
+        if(samples.capacity == 0) continue;
+        samples.samples = malloc(samples.capacity * sizeof(samples.samples[0]));
+        assert(samples.samples);
+        for(int thread = 0; thread <= MAX_WORKERS; thread++)
+        {
+            const ProfileRing* ring = profileRings[thread][zone];
+            for(Uint32 i = 0; ring && (i < SDL_min(ring->count, PROFILE_RING_SIZE)); i++)
+            {
+                samples.samples[samples.count++] = (ring->ends[i] - ring->starts[i]) * 1000000.0f / SDL_GetPerformanceFrequency();
+            }
+        }
+        BenchReport(&samples);
+    }
+}
+
+// write the events the rings still hold as a Chrome trace (chrome://tracing, Perfetto)
+bool ProfileDump(const char* file)
+{
+    FILE* f = fopen(file, "w");
+    if(!f) return false;
+    Uint64 origin = SDL_MAX_UINT64;
+    for(int thread = 0; thread <= MAX_WORKERS; thread++)
+        for(int zone = 0; zone < NB_ZONES; zone++)
+        {
+            const ProfileRing* ring = profileRings[thread][zone];
+            for(Uint32 i = 0; ring && (i < SDL_min(ring->count, PROFILE_RING_SIZE)); i++)
+            {
+                origin = SDL_min(origin, ring->starts[i]);
+            }
+        }
+    double toUs = 1000000.0 / SDL_GetPerformanceFrequency();
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+    for(int thread = 1; thread <= MAX_WORKERS; thread++)
+    {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", thread, thread);
+    }
+    for(int thread = 0; thread <= MAX_WORKERS; thread++)
+        for(int zone = 0; zone < NB_ZONES; zone++)
+        {
+            const ProfileRing* ring = profileRings[thread][zone];
+            for(Uint32 i = 0; ring && (i < SDL_min(ring->count, PROFILE_RING_SIZE)); i++)
+            {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    zoneNames[zone], thread, (ring->starts[i] - origin) * toUs, (ring->ends[i] - ring->starts[i]) * toUs);
+            }
+        }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
+
+void ProfileFree()
+{
+    for(int thread = 0; thread <= MAX_WORKERS; thread++)
+        for(int zone = 0; zone < NB_ZONES; zone++)
+        {
+            free(profileRings[thread][zone]);
+            profileRings[thread][zone] = NULL;
+        }
+}
+#else
+#define PROFILE_BEGIN(zone)
+#define PROFILE_END(zone)
+#define PROFILE_THREAD(worker)
+
+void ProfileReport()
+{
+}
+
+bool ProfileDump(const char* file)
+{
+    return false;
+}
+
+void ProfileFree()
+{
+}
+#endif
+
+void RunItems(int worker)
+{
+    int item;
+    while((item = SDL_AtomicAdd(&pool.nextItem, 1)) < pool.nbItems)
+    {
+        pool.job(item, worker, pool.data);
+    }
+}
+
+int WorkerMain(void* data)
+{
+    int worker = (int)(intptr_t)data;
+    PROFILE_THREAD(worker);
+    Uint32 jobId = 0;
+    SDL_LockMutex(pool.lock);
+    while(true)
+    {
+        while(!pool.quit && (pool.jobId == jobId))
+        {
+            SDL_CondWait(pool.wake, pool.lock);
+        }
+        if(pool.quit) break;
+        jobId = pool.jobId;
+        SDL_UnlockMutex(pool.lock);
+        RunItems(worker);
+        SDL_LockMutex(pool.lock);
+        pool.nbRunning--;
+        if(pool.nbRunning == 0) SDL_CondSignal(pool.done);
+    }
+    SDL_UnlockMutex(pool.lock);
+    return 0;
+}
+
+void ThreadPoolInit(int nbThreads)
+{
+    memset(&pool, 0, sizeof(pool));
+    pool.lock = SDL_CreateMutex();
+    pool.wake = SDL_CreateCond();
+    pool.done = SDL_CreateCond();
+    assert(pool.lock && pool.wake && pool.done);
+    for(int i = 0; i < SDL_min(nbThreads, MAX_WORKERS); i++)
+    {
+        pool.threads[pool.nbThreads] = SDL_CreateThread(WorkerMain, "worker", (void*)(intptr_t)(pool.nbThreads + 1));
+        if(!pool.threads[pool.nbThreads]) break;
+        pool.nbThreads++;
+    }
+}
+
+void ThreadPoolFree()
+{
+    if(!pool.lock) return;
+    SDL_LockMutex(pool.lock);
+    pool.quit = true;
+    SDL_CondBroadcast(pool.wake);
+    SDL_UnlockMutex(pool.lock);
+    for(int i = 0; i < pool.nbThreads; i++)
+    {
+        SDL_WaitThread(pool.threads[i], NULL);
+    }
+    SDL_DestroyCond(pool.done);
+    SDL_DestroyCond(pool.wake);
+    SDL_DestroyMutex(pool.lock);
+    memset(&pool, 0, sizeof(pool));
+}
+
+// call job(item, worker, data) for every item in [0, nbItems) on the workers and the calling 
+// thread, and return once all are done; worker is in [0, MAX_WORKERS]
+void ParallelFor(int nbItems, void job(int, int, void*), void* data)
+{
+    if((pool.nbThreads == 0) || (nbItems <= 1))
+    {
+        for(int i = 0; i < nbItems; i++)
+        {
+            job(i, 0, data);
+        }
+        return;
+    }
+    SDL_LockMutex(pool.lock);
+    pool.job = job;
+    pool.data = data;
+    pool.nbItems = nbItems;
+    SDL_AtomicSet(&pool.nextItem, 0);
+    pool.nbRunning = pool.nbThreads;
+    pool.jobId++;
+    SDL_CondBroadcast(pool.wake);
+    SDL_UnlockMutex(pool.lock);
+    RunItems(0);
+    SDL_LockMutex(pool.lock);
+    while(pool.nbRunning > 0)
+    {
+        SDL_CondWait(pool.done, pool.lock);
+    }
+    SDL_UnlockMutex(pool.lock);
+}
+
+SDL_Rect SpriteSrcRect(int spriteIndex)
+{
+    const int spriteSheetColumns = 8;
+    SDL_Rect srcrect = {
+        ((spriteIndex - 1) % spriteSheetColumns) * gridSize, 
+        ((spriteIndex - 1) / spriteSheetColumns) * gridSize, 
+        gridSize, 
+        gridSize
+    };
+    return srcrect;
+}
+
+void RenderSpriteIndex(SDL_Renderer* renderer, SDL_Texture* texture, int spriteIndex, const SDL_Rect* dstrect)
+{
+    if(spriteIndex > 0)
+    {
+        SDL_Rect srcrect = SpriteSrcRect(spriteIndex);
+        SDL_RenderCopy(renderer, texture, &srcrect, dstrect);
+    }
+}
+
+void BatchBegin(SpriteBatch* batch, SDL_Texture* texture, const SDL_Rect* view)
+{
+    batch->texture = texture;
+    batch->view = *view;
+    batch->count = 0;
+}
+
+void BatchSprite(SpriteBatch* batch, int spriteIndex, const SDL_Rect* dstrect)
+{
+    if((spriteIndex <= 0) || !SDL_HasIntersection(dstrect, &batch->view)) return;
+    if(batch->count == batch->capacity)
+    {
+        batch->capacity = batch->capacity ? 2 * batch->capacity : 256;
+        batch->srcrects = GrowArray(batch->srcrects, batch->capacity, sizeof(batch->srcrects[0]));
+        batch->dstrects = GrowArray(batch->dstrects, batch->capacity, sizeof(batch->dstrects[0]));
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+        batch->vertices = GrowArray(batch->vertices, 4 * batch->capacity, sizeof(batch->vertices[0]));
+        batch->indices = GrowArray(batch->indices, 6 * batch->capacity, sizeof(batch->indices[0]));
+#endif
+    }
+    batch->srcrects[batch->count] = SpriteSrcRect(spriteIndex);
+    batch->dstrects[batch->count] = *dstrect;
+    batch->count++;
+}
+
+// draw the queued quads in one SDL_RenderGeometry call, or one SDL_RenderCopy each where
+// geometry isn't available (SDL before 2.0.18, or a renderer that refuses it)
+void BatchFlush(SDL_Renderer* renderer, SpriteBatch* batch)
+{
+    if(batch->count == 0) return;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    int textureWidth, textureHeight;
+    SDL_QueryTexture(batch->texture, NULL, NULL, &textureWidth, &textureHeight);
+    for(int i = 0; i < batch->count; i++)
+    {
+        const SDL_Rect* src = batch->srcrects + i;
+        const SDL_Rect* dst = batch->dstrects + i;
+        float u0 = (float)src->x / textureWidth;
+        float v0 = (float)src->y / textureHeight;
+        float u1 = (float)(src->x + src->w) / textureWidth;
+        float v1 = (float)(src->y + src->h) / textureHeight;
+        SDL_Vertex* v = batch->vertices + 4 * i;
+        v[0] = (SDL_Vertex){{dst->x, dst->y}, {255, 255, 255, 255}, {u0, v0}};
+        v[1] = (SDL_Vertex){{dst->x + dst->w, dst->y}, {255, 255, 255, 255}, {u1, v0}};
+        v[2] = (SDL_Vertex){{dst->x + dst->w, dst->y + dst->h}, {255, 255, 255, 255}, {u1, v1}};
+        v[3] = (SDL_Vertex){{dst->x, dst->y + dst->h}, {255, 255, 255, 255}, {u0, v1}};
+        int* index = batch->indices + 6 * i;
+        index[0] = 4 * i;
+        index[1] = 4 * i + 1;
+        index[2] = 4 * i + 2;
+        index[3] = 4 * i;
+        index[4] = 4 * i + 2;
+        index[5] = 4 * i + 3;
+    }
+    if(SDL_RenderGeometry(renderer, batch->texture, batch->vertices, 4 * batch->count, batch->indices, 6 * batch->count) == 0)
+    {
+        batch->count = 0;
+        return;
+    }
+#endif
+    for(int i = 0; i < batch->count; i++)
+    {
+        SDL_RenderCopy(renderer, batch->texture, batch->srcrects + i, batch->dstrects + i);
+    }
+    batch->count = 0;
+}
+
+void BatchFree(SpriteBatch* batch)
+{
+    free(batch->srcrects);
+    free(batch->dstrects);
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    free(batch->vertices);
+    free(batch->indices);
+#endif
+    memset(batch, 0, sizeof(*batch));
+}
+
+// parse a Tiled Lua export into a binary level image, see LevelHeader
+void* CompileLevel(const char* luaFile, size_t* size)
+{
+    lua_State* L = luaL_newstate();
+    if(luaL_dofile(L, luaFile) != LUA_OK)
+    {
+        printf("%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+    int r = lua_gettop(L);
+
+    LevelHeader header = {LEVEL_MAGIC, LEVEL_VERSION, 0, 0, NB_LAYERS, 0};
+    header.width = get_int_at_key(L, "width");
+    header.height = get_int_at_key(L, "height");
+    assert((header.width > 0) && (header.height > 0) && (header.width <= 0xFFFF) && (header.height <= 0xFFFF));
+    int nbCells = header.width * header.height;
+    Uint16* tiles = malloc(NB_LAYERS * nbCells * sizeof(tiles[0]));
+    assert(tiles);
+
+    lua_pushstring(L, "layers");
+    r = lua_gettable(L, -2);
+    assert(r == LUA_TTABLE);
+
+    int nb_layers = luaL_len(L, -1);
+    assert(nb_layers == NB_LAYERS);
+
+    for(int i = 0; i < nb_layers; i++) 
+    {
+        r = lua_geti(L, -1, i + 1); // 1-based
+        assert(r == LUA_TTABLE);
+
+        lua_pushstring(L, "data");
+        int data = lua_gettable(L, -2);
+        assert(data == LUA_TTABLE);
+
+        int data_len = luaL_len(L, -1);
+        assert(data_len == nbCells);
+        for(int j = 1; j <= data_len; j++) // 1-based
+        {
+            r = lua_geti(L, -1, j); 
+            assert(r == LUA_TNUMBER);
+            r = lua_tointeger(L, -1);
+            assert((r >= 0) && (r <= 0xFFFF));
+            tiles[i * nbCells + j - 1] = r;
+            if(((i == LAYER_MOBS) || (i == LAYER_ITEMS)) && (r > 0)) header.nbSpawns++;
+
+            lua_pop(L, 1); // pop the element
+        }
+
+        lua_pop(L, 1); // pop the data
+
+        lua_pop(L, 1); // pop the layer
+    }
+
+    lua_pop(L, 1); // pop layers
+    
+    lua_close(L);
+
+    // header, then the layers one after the other, then the spawns in load order
+    *size = sizeof(header) + NB_LAYERS * nbCells * sizeof(tiles[0]) + header.nbSpawns * sizeof(LevelSpawn);
+    Uint8* image = malloc(*size);
+    assert(image);
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + sizeof(header), tiles, NB_LAYERS * nbCells * sizeof(tiles[0]));
+    LevelSpawn* spawn = (LevelSpawn*)(image + sizeof(header) + NB_LAYERS * nbCells * sizeof(tiles[0]));
+    const int spawnLayers[] = {LAYER_MOBS, LAYER_ITEMS};
+    for(int i = 0; i < 2; i++)
+        for(int j = 0; j < nbCells; j++)
+        {
+            Uint16 tile = tiles[spawnLayers[i] * nbCells + j];
+            if(tile == 0) continue;
+            spawn->x = j % header.width;
+            spawn->y = j / header.width;
+            spawn->layer = spawnLayers[i];
+            spawn->spriteIndex = tile;
+            spawn++;
+        }
+    free(tiles);
+    return image;
+}
+
+// written aside then renamed over the file, so a mapping of the previous file stays valid
+bool WriteLevel(const char* file, const void* image, size_t size)
+{
+    char tempFile[1024];
+    snprintf(tempFile, sizeof(tempFile), "%s.tmp", file);
+    FILE* f = fopen(tempFile, "wb");
+    if(!f) return false;
+    bool isWritten = (fwrite(image, 1, size, f) == size);
+    isWritten = (fclose(f) == 0) && isWritten;
+#ifdef _WIN32
+    if(isWritten) remove(file);
+#endif
+    isWritten = isWritten && (rename(tempFile, file) == 0);
+    if(!isWritten) remove(tempFile);
+    return isWritten;
+}
+
+void CloseLevel(LevelData* level)
+{
+#ifndef _WIN32
+    if(level->isMapped) munmap(level->base, level->size);
+    else
+#endif
+    free(level->base);
+    memset(level, 0, sizeof(*level));
+}
+
+// point into a level image after checking it, taking ownership of it either way
+bool OpenLevel(LevelData* level, void* base, size_t size, bool isMapped)
+{
+    memset(level, 0, sizeof(*level));
+    level->base = base;
+    level->size = size;
+    level->isMapped = isMapped;
+
+    const LevelHeader* header = base;
+    if((size < sizeof(*header)) || (header->magic != LEVEL_MAGIC) || (header->version != LEVEL_VERSION) ||
+       (header->nbLayers != NB_LAYERS) || (header->width == 0) || (header->height == 0) ||
+       (header->width > 0xFFFF) || (header->height > 0xFFFF))
+    {
+        CloseLevel(level);
+        return false;
+    }
+    size_t nbCells = (size_t)header->width * header->height;
+    if(size != sizeof(*header) + NB_LAYERS * nbCells * sizeof(Uint16) + header->nbSpawns * sizeof(LevelSpawn))
+    {
+        CloseLevel(level);
+        return false;
+    }
+    level->header = header;
+    for(int i = 0; i < NB_LAYERS; i++)
+    {
+        level->layers[i] = (const Uint16*)((const Uint8*)base + sizeof(*header)) + i * nbCells;
+    }
+    level->spawns = (const LevelSpawn*)(level->layers[0] + NB_LAYERS * nbCells);
+    for(Uint32 i = 0; i < header->nbSpawns; i++)
+    {
+        const LevelSpawn* spawn = level->spawns + i;
+        if((spawn->x >= header->width) || (spawn->y >= header->height))
+        {
+            CloseLevel(level);
+            return false;
+        }
+    }
+    return true;
+}
+
+// map a binary level read-only, or read it where mmap isn't available
+bool MapLevel(const char* file, LevelData* level)
+{
+#ifndef _WIN32
+    int fd = open(file, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    void* base = MAP_FAILED;
+    if((fstat(fd, &st) == 0) && (st.st_size > 0))
+    {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(base != MAP_FAILED) return OpenLevel(level, base, st.st_size, true);
+#endif
+    FILE* f = fopen(file, "rb");
+    if(!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void* image = (size > 0) ? malloc(size) : NULL;
+    bool isRead = image && (fread(image, 1, size, f) == (size_t)size);
+    fclose(f);
+    if(!isRead)
+    {
+        free(image);
+        return false;
+    }
+    return OpenLevel(level, image, size, false);
+}
+
+// the sprites of the level where it spawns them, over the collision grid
+void SpawnLevel(const LevelData* level)
+{
+    StoreClear(&sprites);
+    StoreClear(&items);
+    player = ENTITY_NONE;
+    actionPoolTop = 0;
+    freeAction = -1;
+    for(Uint32 i = 0; i < level->header->nbSpawns; i++)
+    {
+        const LevelSpawn* spawn = level->spawns + i;
+        switch (spawn->layer)
+        {
+        case LAYER_MOBS:
+            if((spawn->spriteIndex == SPRITE_PLAYERIDLE) && (player == ENTITY_NONE))
+            {
+                player = SpriteInit(&sprites, spawn->x, spawn->y, spawn->spriteIndex, true);
+            }
+            else if(spawn->spriteIndex == SPRITE_ORC)
+            {
+                SpriteInit(&sprites, spawn->x, spawn->y, spawn->spriteIndex, true);
+            }
+            break;
+        case LAYER_ITEMS:
+            SpriteInit(&items, spawn->x, spawn->y, spawn->spriteIndex, false);
+            break;
+        }
+    }
+    IndexBuild(mapWidth, mapHeight);
+}
+
+// set the map up from the open level, collision first since spawned mobs collide too
+void ApplyLevel(const LevelData* level)
+{
+    mapWidth = level->header->width;
+    mapHeight = level->header->height;
+    for(int i = 0; i < NB_LAYERS; i++)
+    {
+        layerData[i] = level->layers[i];
+    }
+    GridInit(&collision, mapWidth, mapHeight);
+    GridInit(&terrain, mapWidth, mapHeight);
+    for(int y = 0; y < mapHeight; y++)
+        for(int x = 0; x < mapWidth; x++)
+        {
+            SetColliding(x, y, layerData[LAYER_COLLISION][y * mapWidth + x] > 0);
+            GridSet(&terrain, x, y, layerData[LAYER_COLLISION][y * mapWidth + x] > 0);
+        }
+    SpawnLevel(level);
+}
+
+void FreeLevel()
+{
+    CloseLevel(&level);
+    for(int i = 0; i < NB_LAYERS; i++)
+    {
+        layerData[i] = NULL;
+    }
+    GridFree(&collision);
+    GridFree(&terrain);
+    IndexFree();
+    mapWidth = mapHeight = 0;
+    hpa.width = hpa.height = 0; // the next HPA* query rebuilds the graph
+    for(int i = 0; i < MAX_CHUNKS; i++)
+    {
+        chunks[i].isLoaded = false; // keep the textures, rebake on demand
+    }
+}
+
+// open levelFile, from its binary cache when the cache is at least as recent as the Lua export,
+// unless isChanged says the export was just written
+bool ReadLevel(LevelData* level, bool isChanged)
+{
+    size_t length = strlen(levelFile);
+    if((length < 4) || (strcmp(levelFile + length - 4, ".lua") != 0))
+    {
+        return MapLevel(levelFile, level);
+    }
+
+    char cacheFile[1024];
+    snprintf(cacheFile, sizeof(cacheFile), "%.*s.lvl", (int)(length - 4), levelFile);
+    struct stat source, cache;
+    bool isStale = isChanged || ((stat(levelFile, &source) == 0) && 
+        ((stat(cacheFile, &cache) != 0) || (cache.st_mtime < source.st_mtime)));
+    if(isStale || !MapLevel(cacheFile, level))
+    {
+        size_t size;
+        void* image = CompileLevel(levelFile, &size);
+        if(!image) return false;
+        if(!WriteLevel(cacheFile, image, size))
+        {
+            printf("Can't write level cache %s\n", cacheFile);
+        }
+        bool isOpen = OpenLevel(level, image, size, false);
+        assert(isOpen);
+    }
+    return true;
+}
+
+bool LoadLualevel()
+{
+    FreeLevel();
+    if(!ReadLevel(&level, false)) return false;
+    ApplyLevel(&level);
+    return true;
+}
+
+// draw one tile layer over cells of a chunk, in map cells, into the current render target
+void BakeChunkLayer(const Chunk* chunk, int layer, const SDL_Rect* cells)
+{
+    int x0 = chunk->pos.x * CHUNK_SIZE;
+    int y0 = chunk->pos.y * CHUNK_SIZE;
+    for(int y = cells->y; y < SDL_min(cells->y + cells->h, mapHeight); y++)
+        for(int x = cells->x; x < SDL_min(cells->x + cells->w, mapWidth); x++)
+        {
+            SDL_Rect dstrect = {(x - x0) * gridSize, (y - y0) * gridSize, gridSize, gridSize};
+            RenderSpriteIndex(renderer, spriteSheetTexture, layerData[layer][y * mapWidth + x], &dstrect);
+        }
+}
+
+// bake cells of a chunk, in map cells, over whatever was baked there before
+void BakeChunk(Chunk* chunk, const SDL_Rect* cells)
+{
+    int x0 = chunk->pos.x * CHUNK_SIZE;
+    int y0 = chunk->pos.y * CHUNK_SIZE;
+    SDL_Rect area = {(cells->x - x0) * gridSize, (cells->y - y0) * gridSize, cells->w * gridSize, cells->h * gridSize};
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE); // fills replace, transparent included
+    SDL_SetRenderTarget(renderer, chunk->background);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderFillRect(renderer, &area);
+    BakeChunkLayer(chunk, LAYER_GROUND, cells);
+    BakeChunkLayer(chunk, LAYER_WALLS, cells);
+    BakeChunkLayer(chunk, LAYER_PROPS, cells);
+    SDL_SetRenderTarget(renderer, chunk->foreground);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderFillRect(renderer, &area);
+    BakeChunkLayer(chunk, LAYER_TOP, cells);
+    SDL_SetRenderTarget(renderer, NULL);
+}
+
+// composite cells of a chunk: what to bake and, when baking on the CPU, where, one RGBA8888
+// pixel buffer per texture, cells.w * gridSize pixels wide
+typedef struct BakeJob
+{
+    Chunk* chunk;
+    SDL_Rect cells; // in map cells, within the chunk
+    Uint32* background;
+    Uint32* foreground;
+} BakeJob;
+
+typedef struct BakeBatch
+{
+    BakeJob* jobs;
+    int nbJobs;
+} BakeBatch;
+
+// exact x / 255 for x in [0, 255 * 255]
+Uint32 Div255(Uint32 x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// src over dst, straight alpha, as SDL_BLENDMODE_BLEND: rgb = src * a + dst * (1 - a),
+// alpha = a + dstAlpha * (1 - a)
+void BlendRow(Uint32* dst, const Uint32* src, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaMask = _mm_set1_epi32(0xFF);
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i a = _mm_and_si128(s, alphaMask);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(a, zero));
+        if(mask == 0xFFFF) continue; // all transparent
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16)); // alpha in every byte of its pixel
+        s = _mm_or_si128(s, alphaMask); // alpha lane blends 255 over dstAlpha
+        __m128i result[2];
+        for(int half_ = 0; half_ < 2; half_++)
+        {
+            __m128i s16 = half_ ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+            __m128i d16 = half_ ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+            __m128i a16 = half_ ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+            __m128i x = _mm_add_epi16(_mm_mullo_epi16(s16, a16), _mm_mullo_epi16(d16, _mm_sub_epi16(max, a16)));
+            x = _mm_add_epi16(x, half);
+            result[half_] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(result[0], result[1]));
+    }
+#endif
+    for(; i < n; i++)
+    {
+        Uint32 a = src[i] & 0xFF;
+        if(a == 0) continue;
+        Uint32 s = src[i] | 0xFF;
+        Uint32 pixel = 0;
+        for(int shift = 0; shift < 32; shift += 8)
+        {
+            pixel |= Div255(((s >> shift) & 0xFF) * a + ((dst[i] >> shift) & 0xFF) * (255 - a)) << shift;
+        }
+        dst[i] = pixel;
+    }
+}
+
+// blend the tile of a layer over one row of cells of a job's buffer
+void BakeRowLayer(const BakeJob* job, Uint32* pixels, int y, int layer)
+{
+    int pitch = job->cells.w * gridSize;
+    Uint32* row = pixels + (y - job->cells.y) * gridSize * pitch;
+    for(int x = job->cells.x; x < SDL_min(job->cells.x + job->cells.w, mapWidth); x++)
+    {
+        int spriteIndex = layerData[layer][y * mapWidth + x];
+        if(spriteIndex <= 0) continue;
+        SDL_Rect src = SpriteSrcRect(spriteIndex);
+        if((src.x + src.w > sheetWidth) || (src.y + src.h > sheetHeight)) continue;
+        for(int j = 0; j < gridSize; j++)
+        {
+            BlendRow(row + j * pitch + (x - job->cells.x) * gridSize, sheetPixels + (src.y + j) * sheetWidth + src.x, gridSize);
+        }
+    }
+}
+
+// one band of a bake: a row of cells of one job, item = job * CHUNK_SIZE + row
+void BakeBandJob(int item, int worker, void* data)
+{
+    const BakeBatch* batch = data;
+    const BakeJob* job = batch->jobs + item / CHUNK_SIZE;
+    int row = item % CHUNK_SIZE;
+    if(row >= job->cells.h) return;
+    PROFILE_BEGIN(ZONE_BAKEBAND);
+    int y = job->cells.y + row;
+    int bandPixels = gridSize * job->cells.w * gridSize;
+    Uint32* background = job->background + row * bandPixels;
+    Uint32* foreground = job->foreground + row * bandPixels;
+    for(int i = 0; i < bandPixels; i++)
+    {
+        background[i] = 0x000000FF; // opaque black
+        foreground[i] = 0;
+    }
+    if(y < mapHeight)
+    {
+        BakeRowLayer(job, job->background, y, LAYER_GROUND);
+        BakeRowLayer(job, job->background, y, LAYER_WALLS);
+        BakeRowLayer(job, job->background, y, LAYER_PROPS);
+        BakeRowLayer(job, job->foreground, y, LAYER_TOP);
+    }
+    PROFILE_END(ZONE_BAKEBAND);
+}
+
+// bake every job: composited on the CPU, bands on all workers, then uploaded with one texture
+// update per texture; drawn tile by tile with the renderer when the sheet has no CPU copy
+void BakeChunks(BakeJob jobs[], int nbJobs)
+{
+    if(nbJobs == 0) return;
+    PROFILE_BEGIN(ZONE_BAKE);
+    if(!sheetPixels)
+    {
+        for(int i = 0; i < nbJobs; i++)
+        {
+            BakeChunk(jobs[i].chunk, &jobs[i].cells);
+        }
+        PROFILE_END(ZONE_BAKE);
+        return;
+    }
+    int size = 0;
+    for(int i = 0; i < nbJobs; i++)
+    {
+        size += 2 * jobs[i].cells.w * jobs[i].cells.h * gridSize * gridSize;
+    }
+    if(size > bakeBufferSize)
+    {
+        bakeBufferSize = size;
+        bakeBuffer = GrowArray(bakeBuffer, bakeBufferSize, sizeof(bakeBuffer[0]));
+    }
+    Uint32* pixels = bakeBuffer;
+    for(int i = 0; i < nbJobs; i++)
+    {
+        int nbPixels = jobs[i].cells.w * jobs[i].cells.h * gridSize * gridSize;
+        jobs[i].background = pixels;
+        jobs[i].foreground = pixels + nbPixels;
+        pixels += 2 * nbPixels;
+    }
+    BakeBatch batch = {jobs, nbJobs};
+    ParallelFor(nbJobs * CHUNK_SIZE, BakeBandJob, &batch);
+    for(int i = 0; i < nbJobs; i++)
+    {
+        const BakeJob* job = jobs + i;
+        SDL_Rect rect = {
+            (job->cells.x - job->chunk->pos.x * CHUNK_SIZE) * gridSize, 
+            (job->cells.y - job->chunk->pos.y * CHUNK_SIZE) * gridSize, 
+            job->cells.w * gridSize, 
+            job->cells.h * gridSize
+        };
+        int pitch = rect.w * sizeof(Uint32);
+        SDL_UpdateTexture(job->chunk->background, &rect, job->background, pitch);
+        SDL_UpdateTexture(job->chunk->foreground, &rect, job->foreground, pitch);
+    }
+    PROFILE_END(ZONE_BAKE);
+}
+
+// chunk at chunk coordinates (cx, cy), evicting the least recently used one if needed; a chunk
+// that was not loaded yet is added to jobs, to be baked
+Chunk* GetChunk(int cx, int cy, BakeJob jobs[], int* nbJobs)
+{
+    Chunk* slot = NULL;
+    for(int i = 0; i < MAX_CHUNKS; i++)
+    {
+        Chunk* chunk = chunks + i;
+        if(chunk->isLoaded && (chunk->pos.x == cx) && (chunk->pos.y == cy))
+        {
+            chunk->lastUsed = chunkFrame;
+            return chunk;
+        }
+        if(!slot || (!chunk->isLoaded && slot->isLoaded) || 
+           (chunk->isLoaded == slot->isLoaded && chunk->lastUsed < slot->lastUsed))
+        {
+            slot = chunk;
+        }
+    }
+    assert(!slot->isLoaded || (slot->lastUsed != chunkFrame)); // budget too small for the view
+    if(!slot->background)
+    {
+        slot->background = SDL_CreateTexture(
+            renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 
+            CHUNK_SIZE * gridSize, CHUNK_SIZE * gridSize);
+        slot->foreground = SDL_CreateTexture(
+            renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 
+            CHUNK_SIZE * gridSize, CHUNK_SIZE * gridSize);
+        SDL_SetTextureBlendMode(slot->foreground, SDL_BLENDMODE_BLEND);
+    }
+    slot->pos.x = cx;
+    slot->pos.y = cy;
+    slot->isLoaded = true;
+    slot->lastUsed = chunkFrame;
+    BakeJob job = {slot, {cx * CHUNK_SIZE, cy * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE}, NULL, NULL};
+    jobs[(*nbJobs)++] = job;
+    return slot;
+}
+
+// make sure the chunks in and around the camera are baked
+void StreamChunks(const SDL_Rect* camera)
+{
+    chunkFrame++;
+    int chunkPixels = CHUNK_SIZE * gridSize;
+    int cx0 = SDL_max(0, (camera->x - CHUNK_MARGIN) / chunkPixels);
+    int cy0 = SDL_max(0, (camera->y - CHUNK_MARGIN) / chunkPixels);
+    int cx1 = SDL_min((mapWidth - 1) / CHUNK_SIZE, (camera->x + camera->w + CHUNK_MARGIN) / chunkPixels);
+    int cy1 = SDL_min((mapHeight - 1) / CHUNK_SIZE, (camera->y + camera->h + CHUNK_MARGIN) / chunkPixels);
+    BakeJob jobs[MAX_CHUNKS];
+    int nbJobs = 0;
+    for(int cy = cy0; cy <= cy1; cy++)
+        for(int cx = cx0; cx <= cx1; cx++)
+        {
+            GetChunk(cx, cy, jobs, &nbJobs);
+        }
+    BakeChunks(jobs, nbJobs);
+}
+
+// copy the visible part of every chunk under the camera, background or foreground
+void RenderChunks(const SDL_Rect* camera, bool foreground)
+{
+    int chunkPixels = CHUNK_SIZE * gridSize;
+    for(int i = 0; i < MAX_CHUNKS; i++)
+    {
+        Chunk* chunk = chunks + i;
+        if(!chunk->isLoaded) continue;
+        SDL_Rect chunkRect = {chunk->pos.x * chunkPixels, chunk->pos.y * chunkPixels, chunkPixels, chunkPixels};
+        SDL_Rect visible;
+        if(!SDL_IntersectRect(&chunkRect, camera, &visible)) continue;
+        SDL_Rect srcrect = {visible.x - chunkRect.x, visible.y - chunkRect.y, visible.w, visible.h};
+        SDL_Rect dstrect = {visible.x - camera->x, visible.y - camera->y, visible.w, visible.h};
+        SDL_RenderCopy(renderer, foreground ? chunk->foreground : chunk->background, &srcrect, &dstrect);
+    }
+}
+
+void FreeChunks()
+{
+    for(int i = 0; i < MAX_CHUNKS; i++)
+    {
+        if(chunks[i].background) SDL_DestroyTexture(chunks[i].background);
+        if(chunks[i].foreground) SDL_DestroyTexture(chunks[i].foreground);
+    }
+    memset(chunks, 0, sizeof(chunks));
+    free(bakeBuffer);
+    bakeBuffer = NULL;
+    bakeBufferSize = 0;
+}
+
+void BatchStoreSprite(SpriteBatch* batch, const SpriteStore* store, int i, float alpha, const SDL_Rect* camera)
+{
+    SDL_Point p = InterpolatedDrawPos(store, i, alpha);
+    SDL_Rect dstrect = {p.x - camera->x, p.y - camera->y, gridSize, gridSize};
+    BatchSprite(batch, store->spriteIndex[i], &dstrect);
+}
+
+// the mobs of the index buckets under the camera, widened by 2 cells for the ones drawn away
+// from their cell: up to a cell while moving, plus the half cell every sprite is raised by
+void BatchMobs(SpriteBatch* batch, float alpha, const SDL_Rect* camera)
+{
+    int bx0 = SDL_max(0, (camera->x / gridSize - 2) / BUCKET_SIZE);
+    int by0 = SDL_max(0, (camera->y / gridSize - 2) / BUCKET_SIZE);
+    int bx1 = SDL_min(mobIndex.nbBucketsX - 1, ((camera->x + camera->w) / gridSize + 2) / BUCKET_SIZE);
+    int by1 = SDL_min(mobIndex.nbBucketsY - 1, ((camera->y + camera->h) / gridSize + 2) / BUCKET_SIZE);
+    for(int by = by0; by <= by1; by++)
+        for(int bx = bx0; bx <= bx1; bx++)
+        {
+            for(int slot = mobIndex.buckets[by * mobIndex.nbBucketsX + bx]; slot >= 0; slot = mobIndex.nextInBucket[slot])
+            {
+                BatchStoreSprite(batch, &sprites, sprites.dense[slot], alpha, camera);
+            }
+        }
+}
+
+int GetNeighbors(SDL_Point p, SDL_Point neighbors[8])
+{
+    int nb_neighbors = 0;
+    Uint32 moves = collision.moves[p.y * collision.width + p.x];
+    while(moves != 0)
+    {
+        int bit = SDL_MostSignificantBitIndex32(moves); // NW first, W last
+        moves &= ~(1u << bit);
+        SDL_Point offset = moveOffsets[7 - bit];
+        neighbors[nb_neighbors].x = p.x + offset.x;
+        neighbors[nb_neighbors++].y = p.y + offset.y;
+    }
+    return nb_neighbors;
+}
+
+// whether the step from a to the cell b next to it is free
+bool CanMove(SDL_Point a, SDL_Point b)
+{
+    if((a.x < 0) || (a.y < 0) || (a.x >= collision.width) || (a.y >= collision.height)) return false;
+    for(int i = 0; i < 8; i++)
+    {
+        if((moveOffsets[i].x == b.x - a.x) && (moveOffsets[i].y == b.y - a.y))
+        {
+            return (collision.moves[a.y * collision.width + a.x] & (0x80 >> i)) != 0;
+        }
+    }
+    return false;
+}
+
+// sift up element at position idx, based on priority
+int SiftUp(HeapItem heap[], int idx)
+{
+    if(idx != 0) // otherwise, no need to sift up
+    {
+        int parent_idx = (idx - 1) / 2;
+        if(heap[parent_idx].priority > heap[idx].priority) // parent has larger f, so swap them
+        {
+            HeapItem tempNode = heap[parent_idx];
+            heap[parent_idx] = heap[idx];
+            heap[idx] = tempNode;
+            // try to sift up again from parent position
+            return SiftUp(heap, parent_idx);
+        }
+    }
+    return 0;
+}
+
+int HeapInsert(PathContext* ctx, int cell, float priority)
+{
+    if(ctx->heapSize == ctx->heapCapacity) // lazy deletion can push a cell more than once
+    {
+        ctx->heapCapacity *= 2;
+        ctx->heap = realloc(ctx->heap, ctx->heapCapacity * sizeof(ctx->heap[0]));
+        assert(ctx->heap);
+    }
+    ctx->heapSize++; // increment heap size
+    ctx->heap[ctx->heapSize - 1].cell = cell; // append item at the end of the heap
+    ctx->heap[ctx->heapSize - 1].priority = priority;
+    return SiftUp(ctx->heap, ctx->heapSize - 1); // sift the new element up
+}
+
+int SiftDown(HeapItem heap[], int idx, int heapSize)
+{
+    int min_idx;
+    int left_child_idx = 2 * idx + 1;
+    int right_child_idx = 2 * idx + 2;
+    if (right_child_idx >= heapSize)
+    {
+        if (left_child_idx >= heapSize)
+            return idx;
+        else
+            min_idx = left_child_idx;
+    }
+    else
+    {
+        if (heap[left_child_idx].priority <= heap[right_child_idx].priority)
+            min_idx = left_child_idx;
+        else
+            min_idx = right_child_idx;
+    }
+    if (heap[idx].priority > heap[min_idx].priority)
+    {
+        HeapItem tmpNode = heap[min_idx];
+        heap[min_idx] = heap[idx];
+        heap[idx] = tmpNode;
+        return SiftDown(heap, min_idx, heapSize);
+    }
+    else
+        return idx;
+}
+
+int HeapPop(PathContext* ctx)
+{
+    int result = ctx->heap[0].cell;
+    // move last element to front
+    ctx->heap[0] = ctx->heap[ctx->heapSize - 1];
+    // decrement heap size
+    ctx->heapSize--;
+    if(ctx->heapSize > 0)
+    {
+        SiftDown(ctx->heap, 0, ctx->heapSize);
+    }
+    return result;
+}
+
+// (re)allocate the context for a width x height grid, keeps its state if the size didn't change
+void PathContextReserve(PathContext* ctx, int width, int height)
+{
+    if((ctx->width == width) && (ctx->height == height)) return;
+    free(ctx->nodes);
+    free(ctx->heap);
+    ctx->width = width;
+    ctx->height = height;
+    ctx->nodes = calloc(width * height, sizeof(ctx->nodes[0]));
+    ctx->heapCapacity = width * height;
+    ctx->heap = malloc(ctx->heapCapacity * sizeof(ctx->heap[0]));
+    assert(ctx->nodes && ctx->heap);
+    ctx->heapSize = 0;
+    ctx->generation = 0;
+}
+
+void PathContextFree(PathContext* ctx)
+{
+    free(ctx->nodes);
+    free(ctx->heap);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+// start a new search: all nodes become stale in O(1) by bumping the generation
+void PathContextBegin(PathContext* ctx)
+{
+    ctx->generation++;
+    if(ctx->generation == 0) // wrapped around, old stamps could look current again
+    {
+        for(int i = 0; i < ctx->width * ctx->height; i++)
+        {
+            ctx->nodes[i].generation = 0;
+        }
+        ctx->generation = 1;
+    }
+    ctx->heapSize = 0;
+}
+
+// node of a cell for the current search, reset on first touch
+PathNode* TouchNode(PathContext* ctx, int cell)
+{
+    PathNode* node = ctx->nodes + cell;
+    if(node->generation != ctx->generation)
+    {
+        node->generation = ctx->generation;
+        node->dFromStart = FLT_MAX;
+        node->isVisited = false;
+    }
+    return node;
+}
+
+SDL_Point CellPosition(const PathContext* ctx, int cell)
+{
+    SDL_Point p = {cell % ctx->width, cell / ctx->width};
+    return p;
+}
+
+float MeleeDistEstimate(SDL_Point a, SDL_Point b)
+{
+    int dx = abs(a.x - b.x);
+    if (dx > 0) dx--;
+    int dy = abs(a.y - b.y);
+    if (dy > 0) dy--;
+    return dx + dy;    
+}
+
+float MoveCost(SDL_Point a, SDL_Point b)
+{
+    int dx = abs(a.x - b.x);
+    int dy = abs(a.y - b.y);
+    return (dx > dy) ? (dx + 0.5f * dy) : (dy + 0.5f * dx);
+}
+
+void Reverse(SDL_Point x[], int length)
+{
+    for(int i = 0; i < length / 2; i++)
+    {
+        SDL_Point tmp = x[length - 1 -i];
+        x[length - 1 -i] = x[i];
+        x[i] = tmp;
+    }
+}
+
+// A* from start until h reaches 0, returns the number of steps written to path (start excluded)
+// or -1 if there is no path that fits in MAX_PATH; bounds, if not NULL, restricts the cells it can use
+int SearchPath(PathContext* ctx, SDL_Point start, SDL_Point end, SDL_Point path[], float h(SDL_Point, SDL_Point), const SDL_Rect* bounds)
+{
+    PathContextBegin(ctx);
+
+    // add start point
+    int startCell = start.y * ctx->width + start.x;
+    TouchNode(ctx, startCell)->dFromStart = 0;
+    HeapInsert(ctx, startCell, h(start, end));
+
+    while(ctx->heapSize > 0)
+    {
+        int currentCell = HeapPop(ctx);
+        PathNode* currentNode = ctx->nodes + currentCell;
+        SDL_Point current = CellPosition(ctx, currentCell);
+        if(h(current, end) == 0.0f) // found path
+        {
+            // backtrack to construct path
+            int length = 0;
+            while(currentCell != startCell)
+            {
+                if(length == MAX_PATH) // too long for path[], treat as unreachable
+                {
+                    return -1;
+                }
+                path[length] = CellPosition(ctx, currentCell);
+                length++;
+                currentCell = ctx->nodes[currentCell].cameFrom;
+            }
+            Reverse(path, length);
+            return length;
+        }
+        else if(!currentNode->isVisited)
+        {
+            SDL_Point neighbors[8];
+            int nb_neighbors = GetNeighbors(current, neighbors);
+            for(int i = 0; i < nb_neighbors; i++)
+            {
+                SDL_Point neighbor = neighbors[i];
+                if(bounds && !SDL_PointInRect(&neighbor, bounds)) continue;
+                int neighborCell = neighbor.y * ctx->width + neighbor.x;
+                PathNode* neighborNode = TouchNode(ctx, neighborCell);
+                float tentativeDFromStart = currentNode->dFromStart + MoveCost(current, neighbor);
+                if(tentativeDFromStart < neighborNode->dFromStart) // found a shorter path from start to neighbor
+                {
+                    neighborNode->cameFrom = currentCell;
+                    neighborNode->dFromStart = tentativeDFromStart;
+                    HeapInsert(ctx, neighborCell, tentativeDFromStart + h(neighbor, end));
+                }
+            }
+            currentNode->isVisited = true;
+        }
+    }
+    return -1;
+}
+
+bool IsWalkable(int x, int y)
+{
+    return (x >= 0) && (y >= 0) && (x < mapWidth) && (y < mapHeight) && !IsColliding(x, y);
+}
+
+// jump point search: walk from p in direction (dx, dy) until reaching a cell that must be 
+// expanded (goal, forced neighbor, or for diagonals a straight jump that finds one), returns 
+// its cell or -1. Without corner cutting, only straight moves can have forced neighbors.
+int Jump(const PathContext* ctx, SDL_Point p, int dx, int dy, SDL_Point end, float h(SDL_Point, SDL_Point))
+{
+    while(true)
+    {
+        // the step into p must be legal
+        if(!IsWalkable(p.x, p.y)) return -1;
+        if((dx != 0) && (dy != 0) && (!IsWalkable(p.x - dx, p.y) || !IsWalkable(p.x, p.y - dy))) return -1;
+
+        if(h(p, end) == 0.0f) return p.y * ctx->width + p.x;
+        if((dx != 0) && (dy != 0))
+        {
+            SDL_Point horizontal = {p.x + dx, p.y};
+            SDL_Point vertical = {p.x, p.y + dy};
+            if((Jump(ctx, horizontal, dx, 0, end, h) >= 0) || (Jump(ctx, vertical, 0, dy, end, h) >= 0))
+                return p.y * ctx->width + p.x;
+        }
+        else if(dx != 0)
+        {
+            if((IsWalkable(p.x, p.y - 1) && !IsWalkable(p.x - dx, p.y - 1)) ||
+               (IsWalkable(p.x, p.y + 1) && !IsWalkable(p.x - dx, p.y + 1)))
+                return p.y * ctx->width + p.x;
+        }
+        else
+        {
+            if((IsWalkable(p.x - 1, p.y) && !IsWalkable(p.x - 1, p.y - dy)) ||
+               (IsWalkable(p.x + 1, p.y) && !IsWalkable(p.x + 1, p.y - dy)))
+                return p.y * ctx->width + p.x;
+        }
+        p.x += dx;
+        p.y += dy;
+    }
+}
+
+int Sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+// directions worth jumping to from a jump point reached going (dx, dy), (0, 0) for the start
+int PrunedDirections(int dx, int dy, SDL_Point directions[8])
+{
+    int nb_directions = 0;
+    if((dx == 0) && (dy == 0))
+    {
+        for(int y = -1; y <= 1; y++)
+            for(int x = -1; x <= 1; x++)
+                if((x != 0) || (y != 0))
+                {
+                    directions[nb_directions].x = x;
+                    directions[nb_directions++].y = y;
+                }
+    }
+    else if((dx != 0) && (dy != 0))
+    {
+        directions[nb_directions].x = dx;
+        directions[nb_directions++].y = dy;
+        directions[nb_directions].x = dx;
+        directions[nb_directions++].y = 0;
+        directions[nb_directions].x = 0;
+        directions[nb_directions++].y = dy;
+    }
+    else
+    {
+        // straight: natural neighbor, plus the sides where forced neighbors can appear
+        int sx = dy, sy = dx; // perpendicular
+        directions[nb_directions].x = dx;
+        directions[nb_directions++].y = dy;
+        directions[nb_directions].x = sx;
+        directions[nb_directions++].y = sy;
+        directions[nb_directions].x = -sx;
+        directions[nb_directions++].y = -sy;
+        directions[nb_directions].x = dx + sx;
+        directions[nb_directions++].y = dy + sy;
+        directions[nb_directions].x = dx - sx;
+        directions[nb_directions++].y = dy - sy;
+    }
+    return nb_directions;
+}
+
+// same contract as SearchPath, but only expands jump points; the gaps between consecutive 
+// jump points are straight or diagonal lines, filled in when building the path
+int SearchPathJPS(PathContext* ctx, SDL_Point start, SDL_Point end, SDL_Point path[], float h(SDL_Point, SDL_Point))
+{
+    PathContextBegin(ctx);
+
+    int startCell = start.y * ctx->width + start.x;
+    TouchNode(ctx, startCell)->dFromStart = 0;
+    HeapInsert(ctx, startCell, h(start, end));
+
+    while(ctx->heapSize > 0)
+    {
+        int currentCell = HeapPop(ctx);
+        PathNode* currentNode = ctx->nodes + currentCell;
+        SDL_Point current = CellPosition(ctx, currentCell);
+        if(h(current, end) == 0.0f) // found path
+        {
+            // count the steps between jump points
+            int length = 0;
+            for(int cell = currentCell; cell != startCell; cell = ctx->nodes[cell].cameFrom)
+            {
+                SDL_Point a = CellPosition(ctx, cell);
+                SDL_Point b = CellPosition(ctx, ctx->nodes[cell].cameFrom);
+                length += SDL_max(abs(a.x - b.x), abs(a.y - b.y));
+            }
+            if(length > MAX_PATH) // too long for path[], treat as unreachable
+            {
+                return -1;
+            }
+            // fill the path backwards, one step at a time
+            int i = length;
+            for(int cell = currentCell; cell != startCell; cell = ctx->nodes[cell].cameFrom)
+            {
+                SDL_Point p = CellPosition(ctx, cell);
+                SDL_Point from = CellPosition(ctx, ctx->nodes[cell].cameFrom);
+                int dx = Sign(p.x - from.x);
+                int dy = Sign(p.y - from.y);
+                while((p.x != from.x) || (p.y != from.y))
+                {
+                    path[--i] = p;
+                    p.x -= dx;
+                    p.y -= dy;
+                }
+            }
+            return length;
+        }
+        else if(!currentNode->isVisited)
+        {
+            int dx = 0, dy = 0;
+            if(currentCell != startCell)
+            {
+                SDL_Point from = CellPosition(ctx, currentNode->cameFrom);
+                dx = Sign(current.x - from.x);
+                dy = Sign(current.y - from.y);
+            }
+            SDL_Point directions[8];
+            int nb_directions = PrunedDirections(dx, dy, directions);
+            for(int i = 0; i < nb_directions; i++)
+            {
+                SDL_Point next = {current.x + directions[i].x, current.y + directions[i].y};
+                int jumpCell = Jump(ctx, next, directions[i].x, directions[i].y, end, h);
+                if(jumpCell < 0) continue;
+                SDL_Point jumpPoint = CellPosition(ctx, jumpCell);
+                PathNode* jumpNode = TouchNode(ctx, jumpCell);
+                float tentativeDFromStart = currentNode->dFromStart + MoveCost(current, jumpPoint);
+                if(tentativeDFromStart < jumpNode->dFromStart) // found a shorter path from start to jump point
+                {
+                    jumpNode->cameFrom = currentCell;
+                    jumpNode->dFromStart = tentativeDFromStart;
+                    HeapInsert(ctx, jumpCell, tentativeDFromStart + h(jumpPoint, end));
+                }
+            }
+            currentNode->isVisited = true;
+        }
+    }
+    return -1;
+}
+
+// Dijkstra from the source cells over the cells in bounds, read the distances with NodeDistance
+void FillDistances(PathContext* ctx, const int sources[], int nbSources, const SDL_Rect* bounds)
+{
+    PathContextBegin(ctx);
+    for(int i = 0; i < nbSources; i++)
+    {
+        TouchNode(ctx, sources[i])->dFromStart = 0;
+        HeapInsert(ctx, sources[i], 0);
+    }
+    while(ctx->heapSize > 0)
+    {
+        int currentCell = HeapPop(ctx);
+        PathNode* currentNode = ctx->nodes + currentCell;
+        if(currentNode->isVisited) continue;
+        currentNode->isVisited = true;
+        SDL_Point current = CellPosition(ctx, currentCell);
+        SDL_Point neighbors[8];
+        int nb_neighbors = GetNeighbors(current, neighbors);
+        for(int i = 0; i < nb_neighbors; i++)
+        {
+            SDL_Point neighbor = neighbors[i];
+            if(!SDL_PointInRect(&neighbor, bounds)) continue;
+            int neighborCell = neighbor.y * ctx->width + neighbor.x;
+            PathNode* neighborNode = TouchNode(ctx, neighborCell);
+            float tentativeDFromStart = currentNode->dFromStart + MoveCost(current, neighbor);
+            if(tentativeDFromStart < neighborNode->dFromStart)
+            {
+                neighborNode->dFromStart = tentativeDFromStart;
+                HeapInsert(ctx, neighborCell, tentativeDFromStart);
+            }
+        }
+    }
+}
+
+float NodeDistance(const PathContext* ctx, int cell)
+{
+    const PathNode* node = ctx->nodes + cell;
+    return (node->generation == ctx->generation) ? node->dFromStart : FLT_MAX;
+}
+
+void HpaFree()
+{
+    if(hpa.clusters)
+    {
+        for(int i = 0; i < hpa.nbClustersX * hpa.nbClustersY; i++)
+        {
+            free(hpa.clusters[i].costs);
+        }
+    }
+    free(hpa.clusters);
+    free(hpa.links);
+    PathContextFree(&hpa.local);
+    PathContextFree(&hpa.abstract);
+    memset(&hpa, 0, sizeof(hpa));
+}
+
+// split the map in clusters, all dirty so the first query builds the whole graph
+void HpaInit(int width, int height)
+{
+    HpaFree();
+    hpa.width = width;
+    hpa.height = height;
+    hpa.nbClustersX = (width + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    hpa.nbClustersY = (height + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    hpa.clusters = calloc(hpa.nbClustersX * hpa.nbClustersY, sizeof(hpa.clusters[0]));
+    hpa.links = calloc(width * height, sizeof(hpa.links[0]));
+    assert(hpa.clusters && hpa.links);
+    for(int cy = 0; cy < hpa.nbClustersY; cy++)
+        for(int cx = 0; cx < hpa.nbClustersX; cx++)
+        {
+            Cluster* cluster = hpa.clusters + cy * hpa.nbClustersX + cx;
+            cluster->rect.x = cx * CLUSTER_SIZE;
+            cluster->rect.y = cy * CLUSTER_SIZE;
+            cluster->rect.w = SDL_min(CLUSTER_SIZE, width - cluster->rect.x);
+            cluster->rect.h = SDL_min(CLUSTER_SIZE, height - cluster->rect.y);
+            cluster->isDirty = true;
+        }
+    hpa.isDirty = true;
+    PathContextReserve(&hpa.local, width, height);
+    PathContextReserve(&hpa.abstract, width * height + 1, 1);
+}
+
+// rescan the border between cluster a and cluster b, on its right if vertical, below otherwise:
+// one edge in the middle of each narrow opening, one at each end of the wide ones
+void ScanBorder(Cluster* a, Cluster* b, bool vertical)
+{
+    int length = vertical ? a->rect.h : a->rect.w;
+    Uint8 bitA = vertical ? LINK_RIGHT : LINK_DOWN;
+    Uint8 bitB = vertical ? LINK_LEFT : LINK_UP;
+    int cellsA[CLUSTER_SIZE];
+    int cellsB[CLUSTER_SIZE];
+    Uint8 oldLinks[CLUSTER_SIZE];
+    bool isOpen[CLUSTER_SIZE + 1];
+    // a horizontal border is two row segments, read a word at a time
+    Uint64 blocked = vertical ? 0 : 
+        RowBits(a->rect.x, a->rect.y + a->rect.h - 1, length) | RowBits(a->rect.x, a->rect.y + a->rect.h, length);
+    for(int i = 0; i < length; i++)
+    {
+        SDL_Point pa = vertical ? 
+            (SDL_Point){a->rect.x + a->rect.w - 1, a->rect.y + i} : 
+            (SDL_Point){a->rect.x + i, a->rect.y + a->rect.h - 1};
+        SDL_Point pb = vertical ? (SDL_Point){pa.x + 1, pa.y} : (SDL_Point){pa.x, pa.y + 1};
+        cellsA[i] = pa.y * hpa.width + pa.x;
+        cellsB[i] = pb.y * hpa.width + pb.x;
+        oldLinks[i] = hpa.links[cellsA[i]] & bitA;
+        hpa.links[cellsA[i]] &= ~bitA;
+        hpa.links[cellsB[i]] &= ~bitB;
+        isOpen[i] = vertical ? (IsWalkable(pa.x, pa.y) && IsWalkable(pb.x, pb.y)) : !((blocked >> i) & 1);
+    }
+    isOpen[length] = false;
+
+    int spanStart = -1;
+    for(int i = 0; i <= length; i++)
+    {
+        if(isOpen[i] && (spanStart < 0))
+        {
+            spanStart = i;
+        }
+        else if(!isOpen[i] && (spanStart >= 0))
+        {
+            int first = spanStart;
+            int last = i - 1;
+            if(i - spanStart < MAX_ENTRANCE_WIDTH) first = last = (spanStart + i - 1) / 2;
+            hpa.links[cellsA[first]] |= bitA;
+            hpa.links[cellsB[first]] |= bitB;
+            hpa.links[cellsA[last]] |= bitA;
+            hpa.links[cellsB[last]] |= bitB;
+            spanStart = -1;
+        }
+    }
+
+    for(int i = 0; i < length; i++)
+    {
+        if((hpa.links[cellsA[i]] & bitA) != oldLinks[i])
+        {
+            a->needsCosts = true;
+            b->needsCosts = true;
+            break;
+        }
+    }
+}
+
+// collect the entrances of a cluster and the distances between them inside the cluster
+void BuildClusterCosts(Cluster* cluster)
+{
+    SDL_Rect* r = &cluster->rect;
+    cluster->nbEntrances = 0;
+    for(int y = r->y; y < r->y + r->h; y++)
+        for(int x = r->x; x < r->x + r->w; x++)
+        {
+            bool onBorder = (y == r->y) || (y == r->y + r->h - 1) || (x == r->x) || (x == r->x + r->w - 1);
+            if(onBorder && hpa.links[y * hpa.width + x])
+            {
+                cluster->entrances[cluster->nbEntrances++] = y * hpa.width + x;
+            }
+        }
+    int nb = cluster->nbEntrances;
+    free(cluster->costs);
+    cluster->costs = malloc(SDL_max(nb * nb, 1) * sizeof(cluster->costs[0]));
+    assert(cluster->costs);
+    for(int i = 0; i < nb; i++)
+    {
+        FillDistances(&hpa.local, cluster->entrances + i, 1, r);
+        for(int j = 0; j < nb; j++)
+        {
+            cluster->costs[i * nb + j] = NodeDistance(&hpa.local, cluster->entrances[j]);
+        }
+    }
+    cluster->needsCosts = false;
+}
+
+// bring the abstract graph up to date with the collision grid, only touching dirty clusters 
+// and the neighbors whose entrances moved
+void HpaRefresh()
+{
+    if(!hpa.isDirty) return;
+    int nbClusters = hpa.nbClustersX * hpa.nbClustersY;
+    for(int i = 0; i < nbClusters; i++)
+    {
+        Cluster* cluster = hpa.clusters + i;
+        if(!cluster->isDirty) continue;
+        int cx = i % hpa.nbClustersX;
+        int cy = i / hpa.nbClustersX;
+        // a border shared by two dirty clusters is scanned by the left/upper one
+        if(cx + 1 < hpa.nbClustersX) ScanBorder(cluster, cluster + 1, true);
+        if(cy + 1 < hpa.nbClustersY) ScanBorder(cluster, cluster + hpa.nbClustersX, false);
+        if((cx > 0) && !cluster[-1].isDirty) ScanBorder(cluster - 1, cluster, true);
+        if((cy > 0) && !cluster[-hpa.nbClustersX].isDirty) ScanBorder(cluster - hpa.nbClustersX, cluster, false);
+    }
+    for(int i = 0; i < nbClusters; i++)
+    {
+        Cluster* cluster = hpa.clusters + i;
+        if(cluster->isDirty || cluster->needsCosts)
+        {
+            cluster->isDirty = false;
+            BuildClusterCosts(cluster);
+        }
+    }
+    hpa.isDirty = false;
+}
+
+// relax an edge of the abstract search
+void RelaxAbstract(PathContext* ctx, int from, int to, float cost, SDL_Point end, float h(SDL_Point, SDL_Point))
+{
+    if(cost == FLT_MAX) return;
+    PathNode* toNode = TouchNode(ctx, to);
+    float tentativeDFromStart = ctx->nodes[from].dFromStart + cost;
+    if(tentativeDFromStart < toNode->dFromStart)
+    {
+        toNode->cameFrom = from;
+        toNode->dFromStart = tentativeDFromStart;
+        int goalNode = hpa.width * hpa.height;
+        SDL_Point p = {to % hpa.width, to / hpa.width};
+        HeapInsert(ctx, to, tentativeDFromStart + ((to == goalNode) ? 0.0f : h(p, end)));
+    }
+}
+
+// hierarchical search: A* over cluster entrances, then each hop is refined by a search bounded 
+// to its cluster. Goal cells are assumed to be in the 3x3 block around end, which holds for 
+// MoveCost and MeleeDistEstimate. Paths are near-optimal, not always the shortest.
+int SearchPathHPA(SDL_Point start, SDL_Point end, SDL_Point path[], float h(SDL_Point, SDL_Point))
+{
+    if((hpa.width != mapWidth) || (hpa.height != mapHeight)) HpaInit(mapWidth, mapHeight);
+    HpaRefresh();
+
+    // nearby goals: the abstract graph doesn't help, search directly
+    SDL_Point clampedEnd = {SDL_max(0, SDL_min(end.x, hpa.width - 1)), SDL_max(0, SDL_min(end.y, hpa.height - 1))};
+    if((abs(start.x / CLUSTER_SIZE - clampedEnd.x / CLUSTER_SIZE) <= 1) && 
+       (abs(start.y / CLUSTER_SIZE - clampedEnd.y / CLUSTER_SIZE) <= 1))
+    {
+        return SearchPath(&hpa.local, start, end, path, h, NULL);
+    }
+
+    // connect the start to the entrances of its cluster
+    int startCell = start.y * hpa.width + start.x;
+    Cluster* startCluster = ClusterAt(start);
+    float startCosts[4 * CLUSTER_SIZE];
+    FillDistances(&hpa.local, &startCell, 1, &startCluster->rect);
+    for(int i = 0; i < startCluster->nbEntrances; i++)
+    {
+        startCosts[i] = NodeDistance(&hpa.local, startCluster->entrances[i]);
+    }
+
+    // connect the entrances of the clusters holding goal cells to the goal
+    Cluster* goalClusters[4];
+    int nbGoalClusters = 0;
+    int goalEntrances[4 * 4 * CLUSTER_SIZE];
+    float goalCosts[4 * 4 * CLUSTER_SIZE];
+    int nbGoalEntrances = 0;
+    for(int dy = -1; dy <= 1; dy++)
+        for(int dx = -1; dx <= 1; dx++)
+        {
+            SDL_Point p = {end.x + dx, end.y + dy};
+            if((p.x < 0) || (p.y < 0) || (p.x >= hpa.width) || (p.y >= hpa.height)) continue;
+            Cluster* cluster = ClusterAt(p);
+            bool isKnown = false;
+            for(int i = 0; i < nbGoalClusters; i++) isKnown |= (goalClusters[i] == cluster);
+            if(isKnown) continue;
+            goalClusters[nbGoalClusters++] = cluster;
+
+            int goalCells[9];
+            int nbGoalCells = 0;
+            for(int gy = end.y - 1; gy <= end.y + 1; gy++)
+                for(int gx = end.x - 1; gx <= end.x + 1; gx++)
+                {
+                    SDL_Point g = {gx, gy};
+                    if(SDL_PointInRect(&g, &cluster->rect) && IsWalkable(gx, gy) && (h(g, end) == 0.0f))
+                    {
+                        goalCells[nbGoalCells++] = gy * hpa.width + gx;
+                    }
+                }
+            if(nbGoalCells == 0) continue;
+            FillDistances(&hpa.local, goalCells, nbGoalCells, &cluster->rect);
+            for(int i = 0; i < cluster->nbEntrances; i++)
+            {
+                goalEntrances[nbGoalEntrances] = cluster->entrances[i];
+                goalCosts[nbGoalEntrances++] = NodeDistance(&hpa.local, cluster->entrances[i]);
+            }
+        }
+
+    // abstract search
+    PathContext* ctx = &hpa.abstract;
+    int goalNode = hpa.width * hpa.height;
+    PathContextBegin(ctx);
+    TouchNode(ctx, startCell)->dFromStart = 0;
+    HeapInsert(ctx, startCell, h(start, end));
+    while(ctx->heapSize > 0)
+    {
+        int currentCell = HeapPop(ctx);
+        if(currentCell == goalNode) break;
+        PathNode* currentNode = ctx->nodes + currentCell;
+        if(currentNode->isVisited) continue;
+        currentNode->isVisited = true;
+
+        SDL_Point current = {currentCell % hpa.width, currentCell / hpa.width};
+        Cluster* cluster = ClusterAt(current);
+        // edges inside the cluster
+        if(currentCell == startCell)
+        {
+            for(int i = 0; i < cluster->nbEntrances; i++)
+                RelaxAbstract(ctx, currentCell, cluster->entrances[i], startCosts[i], end, h);
+        }
+        else
+        {
+            int slot = 0;
+            while(cluster->entrances[slot] != currentCell) slot++;
+            const float* costs = cluster->costs + slot * cluster->nbEntrances;
+            for(int i = 0; i < cluster->nbEntrances; i++)
+                RelaxAbstract(ctx, currentCell, cluster->entrances[i], costs[i], end, h);
+        }
+        // edges to neighbor clusters
+        Uint8 links = hpa.links[currentCell];
+        if(links & LINK_UP) RelaxAbstract(ctx, currentCell, currentCell - hpa.width, 1.0f, end, h);
+        if(links & LINK_RIGHT) RelaxAbstract(ctx, currentCell, currentCell + 1, 1.0f, end, h);
+        if(links & LINK_DOWN) RelaxAbstract(ctx, currentCell, currentCell + hpa.width, 1.0f, end, h);
+        if(links & LINK_LEFT) RelaxAbstract(ctx, currentCell, currentCell - 1, 1.0f, end, h);
+        // edges to the goal
+        for(int i = 0; i < nbGoalEntrances; i++)
+        {
+            if(goalEntrances[i] == currentCell) RelaxAbstract(ctx, currentCell, goalNode, goalCosts[i], end, h);
+        }
+    }
+    if(NodeDistance(ctx, goalNode) == FLT_MAX) return -1;
+
+    // walk back the abstract path, each hop advances at least one cell
+    int hops[MAX_PATH + 1];
+    int nbHops = 0;
+    for(int node = goalNode; node != startCell; node = ctx->nodes[node].cameFrom)
+    {
+        if(nbHops == MAX_PATH + 1) return -1;
+        hops[nbHops++] = node;
+    }
+
+    // refine the hops, in order
+    int length = 0;
+    SDL_Point from = start;
+    for(int i = nbHops - 1; i >= 0; i--)
+    {
+        SDL_Point segment[MAX_PATH];
+        int segmentLength;
+        Cluster* cluster = ClusterAt(from);
+        if(hops[i] == goalNode)
+        {
+            segmentLength = SearchPath(&hpa.local, from, end, segment, h, &cluster->rect);
+        }
+        else
+        {
+            SDL_Point to = {hops[i] % hpa.width, hops[i] / hpa.width};
+            if(ClusterAt(to) != cluster)
+            {
+                segment[0] = to;
+                segmentLength = 1;
+            }
+            else
+            {
+                segmentLength = SearchPath(&hpa.local, from, to, segment, MoveCost, &cluster->rect);
+            }
+        }
+        if((segmentLength < 0) || (length + segmentLength > MAX_PATH)) return -1;
+        memcpy(path + length, segment, segmentLength * sizeof(path[0]));
+        length += segmentLength;
+        if(length > 0) from = path[length - 1];
+    }
+    return length;
+}
+
+// the cached path for the query, or the least useful entry to replace, with a miss counted
+CachedPath* PathCacheLookup(PathCache* cache, SDL_Point start, SDL_Point end, float h(SDL_Point, SDL_Point), bool* isHit)
+{
+    cache->clock++;
+    CachedPath* victim = NULL;
+    for(int i = 0; i < cache->nbEntries; i++)
+    {
+        CachedPath* entry = cache->entries + i;
+        if((entry->version == collision.version) && (entry->h == h) &&
+            (entry->start.x == start.x) && (entry->start.y == start.y) && 
+            (entry->end.x == end.x) && (entry->end.y == end.y))
+        {
+            entry->lastUsed = cache->clock;
+            cache->hits++;
+            *isHit = true;
+            return entry;
+        }
+        // paths found before the grid changed go first, then the least recently used
+        bool isStale = (entry->version != collision.version);
+        bool isVictimStale = victim && (victim->version != collision.version);
+        if(!victim || (isStale && !isVictimStale) || ((isStale == isVictimStale) && (entry->lastUsed < victim->lastUsed)))
+        {
+            victim = entry;
+        }
+    }
+    if(cache->nbEntries < PATH_CACHE_SIZE) victim = cache->entries + cache->nbEntries++;
+    victim->start = start;
+    victim->end = end;
+    victim->h = h;
+    victim->version = collision.version;
+    victim->lastUsed = cache->clock;
+    cache->misses++;
+    *isHit = false;
+    return victim;
+}
+
+int FindPath(SDL_Point start, SDL_Point end, SDL_Point path[], float h(SDL_Point, SDL_Point))
+{
+    Uint64 benchStart = SDL_GetPerformanceCounter();
+    PROFILE_BEGIN(ZONE_FINDPATH);
+    bool isHit;
+    CachedPath* cached = PathCacheLookup(&pathCache, start, end, h, &isHit);
+    if(isHit)
+    {
+        if(cached->length > 0) memcpy(path, cached->path, cached->length * sizeof(path[0]));
+        PROFILE_END(ZONE_FINDPATH);
+        BenchRecord(&benchFindPath, benchStart);
+        return cached->length;
+    }
+    PathContextReserve(&pathContext, mapWidth, mapHeight);
+    int length;
+    switch (pathMode)
+    {
+    case PATH_JPS:
+        length = SearchPathJPS(&pathContext, start, end, path, h);
+        break;
+    case PATH_HPA:
+        length = SearchPathHPA(start, end, path, h);
+        break;
+    default:
+        length = SearchPath(&pathContext, start, end, path, h, NULL);
+        break;
+    }
+    cached->length = length;
+    if(length > 0) memcpy(cached->path, path, length * sizeof(path[0]));
+    PROFILE_END(ZONE_FINDPATH);
+    BenchRecord(&benchFindPath, benchStart);
+    return length;
+}
+
+// D* Lite over the collision grid, searching back from the goal so that its costs stay valid as 
+// the start moves: priority of a cell, compared first by k1 then by k2
+bool DStarKeyLess(float a1, float a2, float b1, float b2)
+{
+    return (a1 < b1) || ((a1 == b1) && (a2 < b2));
+}
+
+DStarNode* DStarTouch(DStarPlanner* planner, int cell)
+{
+    DStarNode* node = planner->nodes + cell;
+    if(node->generation != planner->generation)
+    {
+        node->generation = planner->generation;
+        node->g = node->rhs = FLT_MAX;
+        node->isOpen = false;
+    }
+    return node;
+}
+
+void DStarHeapPush(DStarPlanner* planner, int cell, float k1, float k2)
+{
+    if(planner->heapSize == planner->heapCapacity) // lazy deletion can push a cell more than once
+    {
+        planner->heapCapacity = planner->heapCapacity ? 2 * planner->heapCapacity : 1024;
+        planner->heap = GrowArray(planner->heap, planner->heapCapacity, sizeof(planner->heap[0]));
+    }
+    int i = planner->heapSize++;
+    DStarItem item = {k1, k2, cell};
+    while(i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if(!DStarKeyLess(k1, k2, planner->heap[parent].k1, planner->heap[parent].k2)) break;
+        planner->heap[i] = planner->heap[parent];
+        i = parent;
+    }
+    planner->heap[i] = item;
+}
+
+void DStarHeapPop(DStarPlanner* planner)
+{
+    DStarItem item = planner->heap[--planner->heapSize];
+    int i = 0;
+    while(2 * i + 1 < planner->heapSize)
+    {
+        int child = 2 * i + 1;
+        if((child + 1 < planner->heapSize) && 
+            DStarKeyLess(planner->heap[child + 1].k1, planner->heap[child + 1].k2, planner->heap[child].k1, planner->heap[child].k2))
+        {
+            child++;
+        }
+        if(!DStarKeyLess(planner->heap[child].k1, planner->heap[child].k2, item.k1, item.k2)) break;
+        planner->heap[i] = planner->heap[child];
+        i = child;
+    }
+    planner->heap[i] = item;
+}
+
+// top of the open list, dropping the entries of cells that were removed or queued again since
+const DStarItem* DStarTop(DStarPlanner* planner)
+{
+    while(planner->heapSize > 0)
+    {
+        const DStarItem* top = planner->heap;
+        const DStarNode* node = planner->nodes + top->cell;
+        if(node->isOpen && (node->k1 == top->k1) && (node->k2 == top->k2)) return top;
+        DStarHeapPop(planner);
+    }
+    return NULL;
+}
+
+void DStarOpen(DStarPlanner* planner, int cell)
+{
+    DStarNode* node = planner->nodes + cell;
+    SDL_Point p = {cell % planner->width, cell / planner->width};
+    node->k2 = SDL_min(node->g, node->rhs);
+    node->k1 = node->k2 + MoveCost(planner->start, p) + planner->km;
+    node->isOpen = true;
+    DStarHeapPush(planner, cell, node->k1, node->k2);
+}
+
+// recompute the cost to goal of a cell from its successors, and queue it if that changed it
+void DStarUpdateCell(DStarPlanner* planner, SDL_Point p)
+{
+    int cell = p.y * planner->width + p.x;
+    DStarNode* node = DStarTouch(planner, cell);
+    if((p.x != planner->goal.x) || (p.y != planner->goal.y))
+    {
+        node->rhs = FLT_MAX;
+        SDL_Point neighbors[8];
+        int nbNeighbors = GetNeighbors(p, neighbors);
+        for(int i = 0; i < nbNeighbors; i++)
+        {
+            const DStarNode* next = DStarTouch(planner, neighbors[i].y * planner->width + neighbors[i].x);
+            if(next->g < FLT_MAX) node->rhs = SDL_min(node->rhs, next->g + MoveCost(p, neighbors[i]));
+        }
+    }
+    node->isOpen = false;
+    if(node->g != node->rhs) DStarOpen(planner, cell);
+}
+
+// update the cells that can move into cell p
+void DStarUpdatePredecessors(DStarPlanner* planner, SDL_Point p)
+{
+    for(int i = 0; i < 8; i++)
+    {
+        SDL_Point q = {p.x + moveOffsets[i].x, p.y + moveOffsets[i].y};
+        if((q.x < 0) || (q.y < 0) || (q.x >= planner->width) || (q.y >= planner->height)) continue;
+        if(CanMove(q, p)) DStarUpdateCell(planner, q);
+    }
+}
+
+void DStarComputePath(DStarPlanner* planner)
+{
+    int startCell = planner->start.y * planner->width + planner->start.x;
+    const DStarItem* top;
+    while((top = DStarTop(planner)) != NULL)
+    {
+        DStarNode* start = DStarTouch(planner, startCell);
+        float startK2 = SDL_min(start->g, start->rhs);
+        float startK1 = (startK2 < FLT_MAX) ? startK2 + planner->km : FLT_MAX;
+        if(!DStarKeyLess(top->k1, top->k2, startK1, startK2) && (start->g == start->rhs)) break;
+        int cell = top->cell;
+        float k1 = top->k1;
+        float k2 = top->k2;
+        DStarHeapPop(planner);
+        DStarNode* node = planner->nodes + cell;
+        SDL_Point p = {cell % planner->width, cell / planner->width};
+        node->isOpen = false;
+        float newK2 = SDL_min(node->g, node->rhs);
+        float newK1 = newK2 + MoveCost(planner->start, p) + planner->km;
+        if(DStarKeyLess(k1, k2, newK1, newK2))
+        {
+            DStarOpen(planner, cell); // the start moved since it was queued
+        }
+        else if(node->g > node->rhs)
+        {
+            node->g = node->rhs;
+            DStarUpdatePredecessors(planner, p);
+        }
+        else
+        {
+            node->g = FLT_MAX;
+            DStarUpdateCell(planner, p);
+            DStarUpdatePredecessors(planner, p);
+        }
+    }
+}
+
+// start over from start to goal with an empty search state
+void DStarBegin(DStarPlanner* planner, SDL_Point start)
+{
+    if((planner->width != mapWidth) || (planner->height != mapHeight))
+    {
+        free(planner->nodes);
+        planner->width = mapWidth;
+        planner->height = mapHeight;
+        planner->nodes = calloc(mapWidth * mapHeight, sizeof(planner->nodes[0]));
+        assert(planner->nodes);
+        planner->generation = 0;
+    }
+    planner->generation++;
+    if(planner->generation == 0) // wrapped around, old stamps could look current again
+    {
+        for(int i = 0; i < planner->width * planner->height; i++)
+        {
+            planner->nodes[i].generation = 0;
+        }
+        planner->generation = 1;
+    }
+    planner->heapSize = 0;
+    planner->start = start;
+    planner->km = 0.0f;
+    DStarNode* goal = DStarTouch(planner, planner->goal.y * planner->width + planner->goal.x);
+    goal->rhs = 0.0f;
+    DStarOpen(planner, planner->goal.y * planner->width + planner->goal.x);
+    planner->isPlanning = true;
+}
+
+// path from start to the goal through the cheapest successors, as SearchPath writes it
+int DStarPath(DStarPlanner* planner, SDL_Point path[])
+{
+    SDL_Point p = planner->start;
+    int length = 0;
+    if(DStarTouch(planner, p.y * planner->width + p.x)->g == FLT_MAX) return -1;
+    while((p.x != planner->goal.x) || (p.y != planner->goal.y))
+    {
+        if(length == MAX_PATH) return -1;
+        SDL_Point neighbors[8];
+        int nbNeighbors = GetNeighbors(p, neighbors);
+        float best = FLT_MAX;
+        for(int i = 0; i < nbNeighbors; i++)
+        {
+            const DStarNode* next = DStarTouch(planner, neighbors[i].y * planner->width + neighbors[i].x);
+            float cost = (next->g < FLT_MAX) ? next->g + MoveCost(p, neighbors[i]) : FLT_MAX;
+            if(cost < best)
+            {
+                best = cost;
+                path[length] = neighbors[i];
+            }
+        }
+        if(best == FLT_MAX) return -1;
+        p = path[length++];
+    }
+    return length;
+}
+
+// follow the moves found to goal, logging the collision changes from now on
+void DStarWatch(DStarPlanner* planner, const SDL_Point path[], int length)
+{
+    planner->isWatching = (length > 0);
+    if(!planner->isWatching) return;
+    planner->goal = path[length - 1];
+    planner->isPlanning = false;
+    planner->nbChanges = 0;
+    planner->version = collision.version;
+}
+
+// path from start to the goal with the collision changes since the last call, repaired from the 
+// search state when there is one; -1 if the goal can't be reached anymore
+int DStarReplan(DStarPlanner* planner, SDL_Point start, SDL_Point path[])
+{
+    bool isSynced = (planner->nbChanges <= MAX_PLANNER_CHANGES) && 
+        (collision.version == planner->version + planner->nbChanges) && 
+        (planner->width == mapWidth) && (planner->height == mapHeight);
+    if(!planner->isPlanning || !isSynced)
+    {
+        if((planner->goal.x >= mapWidth) || (planner->goal.y >= mapHeight)) return -1;
+        DStarBegin(planner, start);
+    }
+    else
+    {
+        planner->km += MoveCost(planner->start, start);
+        planner->start = start;
+        for(int i = 0; i < planner->nbChanges; i++)
+        {
+            SDL_Point p = planner->changes[i];
+            // the cell takes part in the moves of the cells around it
+            for(int y = SDL_max(0, p.y - 1); y <= SDL_min(planner->height - 1, p.y + 1); y++)
+                for(int x = SDL_max(0, p.x - 1); x <= SDL_min(planner->width - 1, p.x + 1); x++)
+                {
+                    DStarUpdateCell(planner, (SDL_Point){x, y});
+                }
+        }
+    }
+    planner->nbChanges = 0;
+    planner->version = collision.version;
+    DStarComputePath(planner);
+    return DStarPath(planner, path);
+}
+
+void DStarFree(DStarPlanner* planner)
+{
+    free(planner->nodes);
+    free(planner->heap);
+    memset(planner, 0, sizeof(*planner));
+}
+
+// restart the field from the free cells around target
+void FieldBegin(DistanceField* field, SDL_Point target)
+{
+    PathContext* ctx = &field->ctx;
+    PathContextReserve(ctx, terrain.width, terrain.height);
+    PathContextBegin(ctx);
+    field->target = target;
+    field->terrainVersion = terrain.version;
+    field->isValid = true;
+    for(int y = SDL_max(0, target.y - 1); y <= SDL_min(terrain.height - 1, target.y + 1); y++)
+        for(int x = SDL_max(0, target.x - 1); x <= SDL_min(terrain.width - 1, target.x + 1); x++)
+        {
+            if(((x == target.x) && (y == target.y)) || GridBit(&terrain, x, y)) continue;
+            TouchNode(ctx, y * ctx->width + x)->dFromStart = 0;
+            HeapInsert(ctx, y * ctx->width + x, 0);
+        }
+}
+
+// settle the next closest cell; false once the field covers everything a MAX_PATH long path can cost,
+// after which the field is only read and can be shared between threads
+bool FieldGrow(DistanceField* field)
+{
+    const float maxDistance = 1.5f * MAX_PATH;
+    PathContext* ctx = &field->ctx;
+    while((ctx->heapSize > 0) && (ctx->heap[0].priority <= maxDistance))
+    {
+        int currentCell = HeapPop(ctx);
+        PathNode* currentNode = ctx->nodes + currentCell;
+        if(currentNode->isVisited) continue;
+        currentNode->isVisited = true;
+        // terrain moves are symmetric, so the moves out of a cell are also the ones into it
+        SDL_Point current = CellPosition(ctx, currentCell);
+        Uint32 moves = terrain.moves[currentCell];
+        while(moves != 0)
+        {
+            int bit = SDL_MostSignificantBitIndex32(moves);
+            moves &= ~(1u << bit);
+            SDL_Point neighbor = {current.x + moveOffsets[7 - bit].x, current.y + moveOffsets[7 - bit].y};
+            if((neighbor.x == field->target.x) && (neighbor.y == field->target.y)) continue;
+            int neighborCell = neighbor.y * ctx->width + neighbor.x;
+            PathNode* neighborNode = TouchNode(ctx, neighborCell);
+            float tentativeDFromStart = currentNode->dFromStart + MoveCost(current, neighbor);
+            if(tentativeDFromStart < neighborNode->dFromStart)
+            {
+                neighborNode->dFromStart = tentativeDFromStart;
+                HeapInsert(ctx, neighborCell, tentativeDFromStart);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+// distance from cell to the ring, growing the field until it is settled; FLT_MAX when out of reach
+float FieldDistance(DistanceField* field, int cell)
+{
+    const PathContext* ctx = &field->ctx;
+    const PathNode* node = ctx->nodes + cell;
+    while(!((node->generation == ctx->generation) && node->isVisited) && FieldGrow(field));
+    return ((node->generation == ctx->generation) && node->isVisited) ? node->dFromStart : FLT_MAX;
+}
+
+// restart the field if the target moved or the terrain changed
+void FieldUpdate(DistanceField* field, SDL_Point target)
+{
+    if(!field->isValid || (field->terrainVersion != terrain.version) || 
+       (field->target.x != target.x) || (field->target.y != target.y))
+    {
+        FieldBegin(field, target);
+    }
+}
+
+// field distance as an A* heuristic toward meleeField's target: exact where no sprite is in the way
+float FieldEstimate(SDL_Point a, SDL_Point b)
+{
+    return FieldDistance(&meleeField, a.y * terrain.width + a.x);
+}
+
+// shortest path from start into the melee ring of meleeField's target, walking down the field;
+// searches with ctx when sprites block all the shortest ways, and then sets isSearched
+int SearchMeleePath(PathContext* ctx, SDL_Point start, SDL_Point path[], bool* isSearched)
+{
+    SDL_Point current = start;
+    float distance = FieldDistance(&meleeField, start.y * terrain.width + start.x);
+    int length = 0;
+    while(distance > 0.0f)
+    {
+        if(distance == FLT_MAX) return -1; // unreachable
+        if(length == MAX_PATH) // too long for path[]
+        {
+            *isSearched = true;
+            return -1;
+        }
+        // first legal move, with the sprites where they are now, that keeps on a shortest way
+        bool isStepped = false;
+        Uint32 moves = collision.moves[current.y * collision.width + current.x];
+        while((moves != 0) && !isStepped)
+        {
+            int bit = SDL_MostSignificantBitIndex32(moves);
+            moves &= ~(1u << bit);
+            SDL_Point neighbor = {current.x + moveOffsets[7 - bit].x, current.y + moveOffsets[7 - bit].y};
+            float neighborDistance = FieldDistance(&meleeField, neighbor.y * terrain.width + neighbor.x);
+            if(neighborDistance + MoveCost(current, neighbor) == distance)
+            {
+                path[length++] = neighbor;
+                current = neighbor;
+                distance = neighborDistance;
+                isStepped = true;
+            }
+        }
+        if(!isStepped)
+        {
+            *isSearched = true;
+            return SearchPath(ctx, start, meleeField.target, path, FieldEstimate, NULL);
+        }
+    }
+    return length;
+}
+
+bool InMeleeRange(Entity a, Entity b)
+{
+    SDL_Point pa = SpritePos(a);
+    SDL_Point pb = SpritePos(b);
+    return (abs(pa.x - pb.x) <= 1) && (abs(pa.y - pb.y) <= 1);
+}
+
+// plan the turn of enemy against the current collision grid; thread safe once meleeField is filled
+void PlanEnemyTurn(Entity enemy, PathContext* ctx, EnemyPlan* plan)
+{
+    plan->start = SpritePos(enemy);
+    plan->reads = (SDL_Rect){plan->start.x, plan->start.y, 1, 1};
+    plan->isInMelee = InMeleeRange(player, enemy);
+    if(plan->isInMelee)
+    {
+        plan->nbMoves = 0;
+        plan->isAttacking = true;
+        return;
+    }
+    // move within melee range
+    bool isSearched = false;
+    int pathLength = SearchMeleePath(ctx, plan->start, plan->path, &isSearched);
+    for(int i = 0; i < pathLength - 1; i++) // moves are read from the start and every cell but the last
+    {
+        int x0 = SDL_min(plan->reads.x, plan->path[i].x);
+        int y0 = SDL_min(plan->reads.y, plan->path[i].y);
+        int x1 = SDL_max(plan->reads.x + plan->reads.w, plan->path[i].x + 1);
+        int y1 = SDL_max(plan->reads.y + plan->reads.h, plan->path[i].y + 1);
+        plan->reads = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+    }
+    if(isSearched) plan->reads = (SDL_Rect){0, 0, mapWidth, mapHeight};
+    plan->nbMoves = SDL_max(0, SDL_min(pathLength, enemyMaxMove));
+    plan->isAttacking = (pathLength <= enemyMaxMove);
+}
+
+void PlanEnemyJob(int item, int worker, void* data)
+{
+    PROFILE_BEGIN(ZONE_PLANENEMY);
+    PathContext* ctx = workerContexts + worker;
+    PathContextReserve(ctx, mapWidth, mapHeight);
+    PlanEnemyTurn(combatEnemies[item], ctx, enemyPlans + item);
+    PROFILE_END(ZONE_PLANENEMY);
+}
+
+// plan every enemy turn at once, all against the collision grid as the phase starts
+void PlanEnemyTurns()
+{
+    Uint64 benchStart = SDL_GetPerformanceCounter();
+    PROFILE_BEGIN(ZONE_ENEMYPLAN);
+    FieldUpdate(&meleeField, SpritePos(player));
+    while(FieldGrow(&meleeField)); // read-only from now on
+    ParallelFor(nbCombatEnemies, PlanEnemyJob, NULL);
+    PROFILE_END(ZONE_ENEMYPLAN);
+    BenchRecord(&benchEnemyPlan, benchStart);
+}
+
+// whether plan a walks through, or leaves, a cell next to one plan b read
+bool PlanTouches(const EnemyPlan* a, const EnemyPlan* b)
+{
+    SDL_Rect area = {b->reads.x - 1, b->reads.y - 1, b->reads.w + 2, b->reads.h + 2};
+    if(SDL_PointInRect(&a->start, &area)) return true;
+    for(int i = 0; i < a->nbMoves; i++)
+    {
+        if(SDL_PointInRect(a->path + i, &area)) return true;
+    }
+    return false;
+}
+
+// plans that can be played at the same time, and still come out as if played one after the other
+bool ArePlansIndependent(const EnemyPlan* a, const EnemyPlan* b)
+{
+    return !PlanTouches(a, b) && !PlanTouches(b, a);
+}
+
+// plan of combatEnemies[index], planned again if an enemy before it moved next to a cell it read:
+// the turn then comes out exactly as if the enemies had been planned one after the other
+const EnemyPlan* CheckEnemyPlan(int index)
+{
+    EnemyPlan* plan = enemyPlans + index;
+    SDL_Rect area = {plan->reads.x - 1, plan->reads.y - 1, plan->reads.w + 2, plan->reads.h + 2};
+    for(int i = 0; i < index; i++)
+    {
+        SDL_Point from = enemyPlans[i].start;
+        SDL_Point to = SpritePos(combatEnemies[i]);
+        if((from.x == to.x) && (from.y == to.y)) continue;
+        if(SDL_PointInRect(&from, &area) || SDL_PointInRect(&to, &area))
+        {
+            PathContextReserve(&pathContext, mapWidth, mapHeight);
+            PlanEnemyTurn(combatEnemies[index], &pathContext, plan);
+            break;
+        }
+    }
+    return plan;
+}
+
+void EnqueueAction(Entity sprite, Action action)
+{
+    int i = EntityIndex(&sprites, sprite);
+    int node = freeAction;
+    if(node >= 0)
+    {
+        freeAction = actionPool[node].next;
+    }
+    else
+    {
+        assert(actionPoolTop < MAX_ACTIONS);
+        node = actionPoolTop++;
+    }
+    actionPool[node].action = action;
+    actionPool[node].next = -1;
+    if(sprites.actionTail[i] >= 0)
+    {
+        actionPool[sprites.actionTail[i]].next = node;
+    }
+    else
+    {
+        sprites.actionHead[i] = node;
+    }
+    sprites.actionTail[i] = node;
+}
+
+void EnqueueMoves(Entity sprite, const SDL_Point path[], int len)
+{
+    for(int i = 0; i < len; i++)
+    {
+        Action action = {ACTION_MOVE, {.to = path[i]}};
+        EnqueueAction(sprite, action);
+    }
+}
+
+void EnqueueAttack(Entity sprite, Entity target)
+{
+    Action action = {ACTION_ATTACK, {.target = target}};
+    EnqueueAction(sprite, action);
+}
+
+Action DequeueAction(int i)
+{
+    int node = sprites.actionHead[i];
+    Action action = actionPool[node].action;
+    sprites.actionHead[i] = actionPool[node].next;
+    if(sprites.actionHead[i] < 0) sprites.actionTail[i] = -1;
+    actionPool[node].next = freeAction;
+    freeAction = node;
+    return action;
+}
+
+bool IsQueueEmpty(int i)
+{
+    return sprites.actionHead[i] < 0;
+}
+
+// nothing playing and nothing queued
+bool IsIdle(Entity sprite)
+{
+    int i = EntityIndex(&sprites, sprite);
+    return (sprites.currentAction[i].tp == ACTION_NONE) && IsQueueEmpty(i);
+}
+
+void ClearQueue(Entity sprite)
+{
+    int i = EntityIndex(&sprites, sprite);
+    if(sprites.actionTail[i] >= 0)
+    {
+        actionPool[sprites.actionTail[i]].next = freeAction;
+        freeAction = sprites.actionHead[i];
+    }
+    sprites.actionHead[i] = sprites.actionTail[i] = -1;
+    sprites.actionProgress[i] = 0.0f;
+}
+
+void AddEnemy(Entity sprite)
+{
+    assert(nbCombatEnemies < MAX_ENEMIES);
+    combatEnemies[nbCombatEnemies] = sprite;
+    nbCombatEnemies++;
+}
+
+void RemoveEnemy(Entity sprite)
+{
+    int i;
+    for(i = 0; i < nbCombatEnemies; i++)
+    {
+        if(combatEnemies[i] == sprite) break;
+    }
+    memmove(&combatEnemies[i], &combatEnemies[i + 1], (nbCombatEnemies - i - 1) * sizeof(combatEnemies[0]));
+    nbCombatEnemies--;
+}
+
+void RemoveMob(Entity sprite)
+{
+    SDL_Point p = SpritePos(sprite);
+    IndexRemove(sprite);
+    SetColliding(p.x, p.y, GridBit(&terrain, p.x, p.y)); // mobs can spawn on walls
+    ClearQueue(sprite);
+    DestroyEntity(&sprites, sprite);
+}
+
+// before the player starts a queued move: once cells changed since the path was found, and for
+// as long as the planner has a search to repair, check and rewrite the moves left to the goal
+void RepairMoves(int i)
+{
+    DStarPlanner* planner = &playerPlanner;
+    if(!planner->isWatching || (planner->nbChanges == 0)) return;
+    if(!planner->isPlanning)
+    {
+        // keep the path while none of its cells got blocked, the player's own one aside
+        SDL_Point to = sprites.currentAction[i].obj.to;
+        bool isFree = IsWalkable(to.x, to.y) || ((to.x == sprites.pos[i].x) && (to.y == sprites.pos[i].y));
+        for(int node = sprites.actionHead[i]; isFree && (node >= 0); node = actionPool[node].next)
+        {
+            if(actionPool[node].action.tp != ACTION_MOVE) break;
+            to = actionPool[node].action.obj.to;
+            isFree = IsWalkable(to.x, to.y) || ((to.x == sprites.pos[i].x) && (to.y == sprites.pos[i].y));
+        }
+        if(isFree)
+        {
+            planner->nbChanges = 0;
+            planner->version = collision.version;
+            return;
+        }
+    }
+    SDL_Point path[MAX_PATH];
+    int length = DStarReplan(planner, sprites.pos[i], path);
+    // keep what follows the moves, the attack at the end
+    Action tail[4];
+    int nbTail = 0;
+    int node = sprites.actionHead[i];
+    while((node >= 0) && (actionPool[node].action.tp == ACTION_MOVE))
+    {
+        node = actionPool[node].next;
+    }
+    for(; node >= 0; node = actionPool[node].next)
+    {
+        assert(nbTail < (int)SDL_arraysize(tail));
+        tail[nbTail++] = actionPool[node].action;
+    }
+    float progress = sprites.actionProgress[i];
+    ClearQueue(player);
+    if(length <= 0)
+    {
+        // there already, or no way there anymore, and then the attack goes too
+        sprites.currentAction[i].tp = ACTION_NONE;
+        planner->isWatching = false;
+        if(length < 0) return;
+    }
+    else
+    {
+        sprites.currentAction[i].obj.to = path[0];
+        EnqueueMoves(player, path + 1, length - 1);
+        sprites.actionProgress[i] = progress;
+    }
+    for(int j = 0; j < nbTail; j++)
+    {
+        EnqueueAction(player, tail[j]);
+    }
+}
+
+void UpdateSprite(Entity sprite, float deltaTime, Rng* rng)
+{
+    int i = EntityIndex(&sprites, sprite);
+    sprites.prevDrawPos[i] = DrawPos(&sprites, i);
+    sprites.prevDrawTick[i] = tick;
+    switch (sprites.currentAction[i].tp)
+    {
+    case ACTION_NONE:
+        // start next action in the queue if there is one
+        if(!IsQueueEmpty(i))
+        {
+            sprites.currentAction[i] = DequeueAction(i);
+            sprites.actionProgress[i] = 0.0f;
+            if((sprite == player) && (sprites.currentAction[i].tp == ACTION_MOVE)) RepairMoves(i);
+        }
+        break;
+    case ACTION_MOVE:
+        // progress the move
+        sprites.actionProgress[i] += moveSpeed * deltaTime;
+        // if finished, update grid position, and move to next action if any
+        if(sprites.actionProgress[i] >= 1.0f)
+        {
+            MoveSprite(sprite, sprites.currentAction[i].obj.to); // update collision grid
+            if(IsQueueEmpty(i))
+            {
+                sprites.currentAction[i].tp = ACTION_NONE;
+                sprites.actionProgress[i] = 0.0f;
+            }
+            else
+            {
+                sprites.currentAction[i] = DequeueAction(i);
+                if(sprites.currentAction[i].tp == ACTION_MOVE)
+                {
+                    sprites.actionProgress[i] -= 1.0f; // roll extra progress into next move
+                    if(sprite == player) RepairMoves(i);
+                }
+                else
+                {
+                    sprites.actionProgress[i] = 0.0f;
+                }
+            }
+        }
+        // update display position
+        sprites.offset[i].x = (sprites.currentAction[i].obj.to.x - sprites.pos[i].x) * sprites.actionProgress[i] * gridSize;
+        sprites.offset[i].y = (sprites.currentAction[i].obj.to.y - sprites.pos[i].y) * sprites.actionProgress[i] * gridSize - 16;
+        break;
+    case ACTION_ATTACK:
+    {
+        int target = EntityIndex(&sprites, sprites.currentAction[i].obj.target);
+        sprites.currentAction[i].tp = ACTION_NONE;
+        sprites.actionProgress[i] = 0.0f;
+        if(target < 0) break; // killed since the attack was queued
+        // attack
+        int attackRoll = RngRoll(rng, 20);
+        GAME_LOG(LOG_INFO, LOG_COMBAT, "attack roll=%d, ", attackRoll);
+        if(attackRoll >= sprites.AC[target])
+        {
+            GAME_LOG(LOG_INFO, LOG_COMBAT, "hit, ");
+            int dmgRoll = RngRoll(rng, 6);
+            GAME_LOG(LOG_INFO, LOG_COMBAT, "dmg=%d, ", dmgRoll);
+            sprites.hp[target] -= dmgRoll;
+            GAME_LOG(LOG_INFO, LOG_COMBAT, "hp=%d, \n", sprites.hp[target]);
+            if(sprites.hp[target] <= 0)
+            {
+                if(sprites.entity[target] != player)
+                {
+                    RemoveEnemy(sprites.entity[target]);
+                    RemoveMob(sprites.entity[target]); // may move this sprite in the store
+                }
+            }
+        }
+        else
+        {
+            GAME_LOG(LOG_INFO, LOG_COMBAT, "miss\n");
+        }
+        break;
+    }
+    }
+}
+
+// advance every sprite that has something to play, in one pass: the player, then the enemies,
+// the only mobs that are ever given actions
+void UpdateSprites(float deltaTime, Rng* rng)
+{
+    Uint64 benchStart = SDL_GetPerformanceCounter();
+    PROFILE_BEGIN(ZONE_UPDATESPRITES);
+    if(!IsIdle(player)) UpdateSprite(player, deltaTime, rng);
+    for(int i = 0; i < nbCombatEnemies; i++)
+    {
+        if(!IsIdle(combatEnemies[i])) UpdateSprite(combatEnemies[i], deltaTime, rng);
+    }
+    PROFILE_END(ZONE_UPDATESPRITES);
+    BenchRecord(&benchUpdateSprite, benchStart);
+}
+
+float SpriteDistance(Entity a, Entity b)
+{
+    SDL_Point pa = SpritePos(a);
+    SDL_Point pb = SpritePos(b);
+    float dx = pa.x - pb.x;
+    float dy = pa.y - pb.y;
+    return sqrtf(dx * dx + dy * dy);
+}
+
+// bounded Dijkstra over the collision grid, from origin out to every cell playerMaxMove affords
+void RangeBegin(RangeMap* range, SDL_Point origin)
+{
+    PathContext* ctx = &range->ctx;
+    PathContextReserve(ctx, collision.width, collision.height);
+    PathContextBegin(ctx);
+    range->origin = origin;
+    range->version = collision.version;
+    range->isValid = true;
+    int originCell = origin.y * ctx->width + origin.x;
+    TouchNode(ctx, originCell)->dFromStart = 0;
+    HeapInsert(ctx, originCell, 0);
+    while((ctx->heapSize > 0) && (ctx->heap[0].priority <= playerMaxMove))
+    {
+        int currentCell = HeapPop(ctx);
+        PathNode* currentNode = ctx->nodes + currentCell;
+        if(currentNode->isVisited) continue;
+        currentNode->isVisited = true;
+        SDL_Point current = CellPosition(ctx, currentCell);
+        SDL_Point neighbors[8];
+        int nbNeighbors = GetNeighbors(current, neighbors);
+        for(int i = 0; i < nbNeighbors; i++)
+        {
+            int neighborCell = neighbors[i].y * ctx->width + neighbors[i].x;
+            PathNode* neighborNode = TouchNode(ctx, neighborCell);
+            float tentativeDFromStart = currentNode->dFromStart + MoveCost(current, neighbors[i]);
+            if(tentativeDFromStart < neighborNode->dFromStart)
+            {
+                neighborNode->cameFrom = currentCell;
+                neighborNode->dFromStart = tentativeDFromStart;
+                HeapInsert(ctx, neighborCell, tentativeDFromStart);
+            }
+        }
+    }
+}
+
+// restart the range if the player moved or the collision grid changed
+void RangeUpdate(RangeMap* range, SDL_Point origin)
+{
+    if(!range->isValid || (range->version != collision.version) || 
+       (range->origin.x != origin.x) || (range->origin.y != origin.y))
+    {
+        RangeBegin(range, origin);
+    }
+}
+
+// cost of the moves from the origin to p, FLT_MAX when out of reach this turn
+float RangeCost(const RangeMap* range, SDL_Point p)
+{
+    const PathContext* ctx = &range->ctx;
+    if((p.x < 0) || (p.y < 0) || (p.x >= ctx->width) || (p.y >= ctx->height)) return FLT_MAX;
+    const PathNode* node = ctx->nodes + p.y * ctx->width + p.x;
+    return ((node->generation == ctx->generation) && node->isVisited) ? node->dFromStart : FLT_MAX;
+}
+
+// the cheapest cell in reach to attack target from, any cell around it, with its cost
+SDL_Point RangeAttackCell(const RangeMap* range, SDL_Point target, float* cost)
+{
+    SDL_Point best = target;
+    *cost = FLT_MAX;
+    for(int i = 0; i < 8; i++)
+    {
+        SDL_Point p = {target.x + moveOffsets[i].x, target.y + moveOffsets[i].y};
+        float pCost = RangeCost(range, p);
+        if(pCost < *cost)
+        {
+            best = p;
+            *cost = pCost;
+        }
+    }
+    return best;
+}
+
+// moves from the origin to a cell in reach, written as SearchPath does
+int RangePath(const RangeMap* range, SDL_Point to, SDL_Point path[])
+{
+    const PathContext* ctx = &range->ctx;
+    int originCell = range->origin.y * ctx->width + range->origin.x;
+    int length = 0;
+    for(int cell = to.y * ctx->width + to.x; cell != originCell; cell = ctx->nodes[cell].cameFrom)
+    {
+        if(length == MAX_PATH) return -1;
+        path[length++] = CellPosition(ctx, cell);
+    }
+    Reverse(path, length);
+    return length;
+}
+
+// scripted mouse for headless runs: every scriptPeriod ticks the cursor jumps either to a 
+// pseudo-random spot of the view or onto a mob (the nearest one, or the first enemy 
+// during combat), and clicks there
+Uint32 ScriptedMouseState(int tick, const SDL_Rect* camera, int* x, int* y)
+{
+    Uint32 hash = (Uint32)(tick / scriptPeriod + 1) * 2654435761u;
+    Entity target = ENTITY_NONE;
+    if(hash & 0x100)
+    {
+        if(gameState != GAME_EXPLORE)
+        {
+            if(nbCombatEnemies > 0) target = combatEnemies[0];
+        }
+        else
+        {
+            for(int i = 0; i < sprites.count; i++)
+            {
+                if(sprites.entity[i] == player) continue;
+                if(!target || (SpriteDistance(player, sprites.entity[i]) < SpriteDistance(player, target))) target = sprites.entity[i];
+            }
+        }
+    }
+    if(target)
+    {
+        SDL_Point p = SpritePos(target);
+        *x = (p.x * gridSize - camera->x + gridSize / 2) * scaling;
+        *y = (p.y * gridSize - camera->y + gridSize / 2) * scaling;
+    }
+    else
+    {
+        *x = (hash >> 8) % (int)(viewColumns * gridSize * scaling);
+        *y = (hash >> 20) % (int)(viewRows * gridSize * scaling);
+    }
+    return (tick % scriptPeriod == scriptPeriod - 1) ? SDL_BUTTON_LMASK : 0;
+}
+
+Uint32 GetMouseState(int tick, const SDL_Rect* camera, int* x, int* y)
+{
+    if(headless)
+    {
+        return ScriptedMouseState(tick, camera, x, y);
+    }
+    SDL_PumpEvents();
+    return SDL_GetMouseState(x, y);
+}
+
+// FNV-1a
+Uint32 HashBytes(Uint32 hash, const void* data, size_t size)
+{
+    const Uint8* bytes = data;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// hash of the state the game plays from, for checking a replay against its recording
+Uint32 StateHash(const Rng* rng)
+{
+    Uint32 hash = 2166136261u;
+    hash = HashBytes(hash, &tick, sizeof(tick));
+    hash = HashBytes(hash, &gameState, sizeof(gameState));
+    hash = HashBytes(hash, &rng->state, sizeof(rng->state));
+    hash = HashBytes(hash, &collision.version, sizeof(collision.version));
+    hash = HashBytes(hash, sprites.pos, sprites.count * sizeof(sprites.pos[0]));
+    hash = HashBytes(hash, sprites.hp, sprites.count * sizeof(sprites.hp[0]));
+    hash = HashBytes(hash, combatEnemies, nbCombatEnemies * sizeof(combatEnemies[0]));
+    return hash;
+}
+
+bool RecordOpen(const char* file, Uint64 seed)
+{
+    recording.file = fopen(file, "wb");
+    if(!recording.file) return false;
+    memset(&recording.header, 0, sizeof(recording.header));
+    recording.header.magic = RECORD_MAGIC;
+    recording.header.version = RECORD_VERSION;
+    recording.header.seed = seed;
+    strncpy(recording.header.levelFile, levelFile, sizeof(recording.header.levelFile) - 1);
+    return fwrite(&recording.header, sizeof(recording.header), 1, recording.file) == 1;
+}
+
+void RecordWrite(RecordType type, Uint32 buttons, SDL_Point cursor, Uint32 hash)
+{
+    RecordEntry entry = {tick, type, buttons, cursor.x, cursor.y, hash};
+    fwrite(&entry, sizeof(entry), 1, recording.file);
+}
+
+// read a whole recording, its level and seed are the ones to play with
+bool ReplayOpen(const char* file)
+{
+    FILE* f = fopen(file, "rb");
+    if(!f) return false;
+    bool isValid = (fread(&recording.header, sizeof(recording.header), 1, f) == 1) &&
+        (recording.header.magic == RECORD_MAGIC) && (recording.header.version == RECORD_VERSION);
+    long start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    recording.nbEntries = isValid ? (ftell(f) - start) / sizeof(RecordEntry) : 0;
+    fseek(f, start, SEEK_SET);
+    recording.entries = malloc((recording.nbEntries + 1) * sizeof(RecordEntry));
+    assert(recording.entries);
+    isValid = isValid && (fread(recording.entries, sizeof(RecordEntry), recording.nbEntries, f) == (size_t)recording.nbEntries);
+    fclose(f);
+    if(!isValid) return false;
+    recording.header.levelFile[sizeof(recording.header.levelFile) - 1] = '\0';
+    recording.next = 0;
+    // a recording cut short ends after its last entry
+    recording.endTick = (recording.nbEntries > 0) ? recording.entries[recording.nbEntries - 1].tick + 1 : 0;
+    for(int i = 0; i < recording.nbEntries; i++)
+    {
+        if(recording.entries[i].type == RECORD_END) recording.endTick = recording.entries[i].tick;
+    }
+    return true;
+}
+
+bool IsReplaying()
+{
+    return recording.entries != NULL;
+}
+
+// buttons held and cell under the cursor this tick: from the mouse, or the recording being replayed
+Uint32 ReadInput(const SDL_Rect* camera, SDL_Point* cursor)
+{
+    if(IsReplaying())
+    {
+        while((recording.next < recording.nbEntries) && (recording.entries[recording.next].tick <= (Uint32)tick) &&
+            (recording.entries[recording.next].type == RECORD_INPUT))
+        {
+            const RecordEntry* entry = recording.entries + recording.next++;
+            recording.cursor = (SDL_Point){entry->x, entry->y};
+            recording.buttons = entry->buttons;
+        }
+        *cursor = recording.cursor;
+        return recording.buttons;
+    }
+    int x, y;
+    Uint32 buttons = GetMouseState(tick, camera, &x, &y);
+    cursor->x = (x / (int)scaling + camera->x) / gridSize;
+    cursor->y = (y / (int)scaling + camera->y) / gridSize;
+    bool isChanged = !recording.hasInput || (buttons != recording.buttons) || 
+        (cursor->x != recording.cursor.x) || (cursor->y != recording.cursor.y);
+    if(recording.file && isChanged) RecordWrite(RECORD_INPUT, buttons, *cursor, 0);
+    recording.cursor = *cursor;
+    recording.buttons = buttons;
+    recording.hasInput = true;
+    return buttons;
+}
+
+// the player's mouse, or the recorded or scripted one, as GameTick reads it; data is the camera
+Uint32 ReadPlayerInput(SDL_Point* cursor, void* data)
+{
+    return ReadInput(data, cursor);
+}
+
+// at the end of a tick: every checkpointPeriod ticks, record the state hash, or check it against
+// the recording
+void Checkpoint(const Rng* rng)
+{
+    if(tick % checkpointPeriod != 0) return;
+    SDL_Point none = {0, 0};
+    if(recording.file)
+    {
+        RecordWrite(RECORD_CHECKPOINT, 0, none, StateHash(rng));
+    }
+    if(IsReplaying())
+    {
+        // skip inputs this replay didn't read, it already went its own way
+        while((recording.next < recording.nbEntries) && (recording.entries[recording.next].tick <= (Uint32)tick) &&
+            (recording.entries[recording.next].type != RECORD_CHECKPOINT))
+        {
+            recording.next++;
+        }
+        if((recording.next < recording.nbEntries) && (recording.entries[recording.next].tick == (Uint32)tick))
+        {
+            Uint32 hash = StateHash(rng);
+            if(hash != recording.entries[recording.next].hash)
+            {
+                if(recording.nbMismatches == 0) GAME_LOG(LOG_ERROR, LOG_STATE, "replay: state differs at tick %d\n", tick);
+                recording.nbMismatches++;
+            }
+            recording.nbCheckpoints++;
+            recording.next++;
+        }
+    }
+}
+
+// finish the recording, or report on the replay; false if the replay went its own way
+bool RecordClose()
+{
+    if(recording.file)
+    {
+        SDL_Point none = {0, 0};
+        RecordWrite(RECORD_END, 0, none, 0);
+        fclose(recording.file);
+    }
+    if(IsReplaying())
+    {
+        printf("replay: %d ticks, %d checkpoints, %d mismatches\n", tick, recording.nbCheckpoints, recording.nbMismatches);
+        free(recording.entries);
+    }
+    bool isMatching = (recording.nbMismatches == 0);
+    memset(&recording, 0, sizeof(recording));
+    return isMatching;
+}
+
+Entity EnemyAtPosition(SDL_Point p)
+{
+    if((p.x < 0) || (p.y < 0) || (p.x >= mobIndex.width) || (p.y >= mobIndex.height)) return ENTITY_NONE;
+    int slot = mobIndex.cells[p.y * mobIndex.width + p.x];
+    return (slot >= 0) ? sprites.entity[sprites.dense[slot]] : ENTITY_NONE;
+}
+
+// what the game loop keeps from one tick to the next, besides the world
+typedef struct TickState
+{
+    Rng rng;
+    SDL_Point cursor;
+    int cursorSpriteIndex;
+    SDL_Point path[MAX_PATH]; // to the cursor, drawn
+    int pathLength;
+    Uint32 prevButtons;
+    int currentEnemy;
+    int waveEnd; // enemies from currentEnemy to waveEnd play together
+} TickState;
+
+void TickStateInit(TickState* state, Uint64 seed)
+{
+    memset(state, 0, sizeof(*state));
+    RngSeed(&state->rng, seed);
+    state->cursorSpriteIndex = SPRITE_MOVETO;
+}
+
+// one game tick of deltaTime seconds: the state machine of exploration and combat, with the
+// mouse buttons and cursor from readInput when the player has a say
+void GameTick(TickState* state, float deltaTime, Uint32 readInput(SDL_Point*, void*), void* data)
+{
+    Entity target = ENTITY_NONE;
+    Uint32 buttons;
+    switch (gameState)
+    {
+    case GAME_EXPLORE:
+        // update cursor
+        buttons = readInput(&state->cursor, data);
+        target = EnemyAtPosition(state->cursor);
+        if(target)
+        {
+            state->cursorSpriteIndex = SPRITE_ATTACK;
+            state->pathLength = FindPath(SpritePos(player), state->cursor, state->path, MeleeDistEstimate);
+        }
+        else
+        {
+            state->cursorSpriteIndex = SPRITE_MOVETO;
+            state->pathLength = FindPath(SpritePos(player), state->cursor, state->path, MoveCost);
+        }
+        if(((buttons & SDL_BUTTON_LMASK) != 0) && ((state->prevButtons & SDL_BUTTON_LMASK) == 0))
+        {
+            ClearQueue(player);
+            EnqueueMoves(player, state->path, state->pathLength);
+            DStarWatch(&playerPlanner, state->path, state->pathLength);
+        }
+        state->prevButtons = buttons;
+        // update player position
+        UpdateSprites(deltaTime, &state->rng);
+        // check aggro
+        PROFILE_BEGIN(ZONE_AGGRO);
+        // the mobs that see the player are the ones it sees, walls block both ways
+        Entity nearby[MAX_ENEMIES];
+        const FovMap* fov = GetFov(&fovCache, SpritePos(player), aggroRadius);
+        int nbNearby = QueryMobs(SpritePos(player), aggroRadius, fov, nearby, MAX_ENEMIES);
+        for(int i = 0; i < nbNearby; i++)
+        {
+            AddEnemy(nearby[i]);
+        }
+        PROFILE_END(ZONE_AGGRO);
+        // if aggro'd start combat
+        if(nbCombatEnemies > 0) 
+        {
+            ClearQueue(player);
+            GAME_LOG(LOG_INFO, LOG_STATE, "combat start, roll initiative\n");
+            state->currentEnemy = 0;
+            // roll initiative
+            if(RngRoll(&state->rng, 2) == 1)
+            {
+                GAME_LOG(LOG_INFO, LOG_STATE, "player has initiative\n");
+                gameState = GAME_COMBAT_PLAYERINPUT;
+            }
+            else
+            {
+                GAME_LOG(LOG_INFO, LOG_STATE, "enemy has initiative\n");
+                gameState = GAME_COMBAT_ENEMYAI;
+            }
+        }
+        break;
+    case GAME_COMBAT_PLAYERINPUT:
+        // update cursor, looked up in the moves the player can afford this turn
+        buttons = readInput(&state->cursor, data);
+        target = EnemyAtPosition(state->cursor);
+        RangeUpdate(&playerRange, SpritePos(player));
+        float cost;
+        SDL_Point to = target ? RangeAttackCell(&playerRange, state->cursor, &cost) : state->cursor;
+        if(!target) cost = RangeCost(&playerRange, state->cursor);
+        if(cost <= playerMaxMove)
+        {
+            state->pathLength = RangePath(&playerRange, to, state->path);
+            state->cursorSpriteIndex = target ? SPRITE_ATTACK : SPRITE_MOVETO;
+        }
+        else
+        {
+            state->pathLength = FindPath(SpritePos(player), state->cursor, state->path, target ? MeleeDistEstimate : MoveCost);
+            state->cursorSpriteIndex = SPRITE_INACCESSIBLE;
+        }
+        if(((buttons & SDL_BUTTON_LMASK) != 0) && ((state->prevButtons & SDL_BUTTON_LMASK) == 0))
+        {
+            ClearQueue(player);
+            EnqueueMoves(player, state->path, state->pathLength);
+            DStarWatch(&playerPlanner, state->path, state->pathLength);
+            if(state->cursorSpriteIndex == SPRITE_ATTACK)
+            {
+                EnqueueAttack(player, target);
+            }
+            gameState = GAME_COMBAT_PLAYERRESOLVE;
+        }
+        state->prevButtons = buttons;
+        break;
+    case GAME_COMBAT_PLAYERRESOLVE:
+        // update player position
+        UpdateSprites(deltaTime, &state->rng);
+        // check if move is finished
+        if(IsIdle(player))
+        {
+            GAME_LOG(LOG_INFO, LOG_STATE, "player finished, ");
+            if(nbCombatEnemies > 0)
+            {
+                GAME_LOG(LOG_INFO, LOG_STATE, "enemy turn\n");
+                gameState = GAME_COMBAT_ENEMYAI;
+            }
+            else
+            {
+                GAME_LOG(LOG_INFO, LOG_STATE, "combat finished\n");
+                gameState = GAME_EXPLORE;
+            }
+        }
+        break;
+    case GAME_COMBAT_ENEMYAI:
+        // play enemy turns, all of them are planned when the phase starts; the next 
+        // enemies whose plans can't interfere with each other go together as a wave
+        if(state->currentEnemy == 0) PlanEnemyTurns();
+        for(state->waveEnd = state->currentEnemy; state->waveEnd < nbCombatEnemies; state->waveEnd++)
+        {
+            const EnemyPlan* plan = CheckEnemyPlan(state->waveEnd);
+            bool isIndependent = true;
+            for(int i = state->currentEnemy; i < state->waveEnd; i++)
+            {
+                isIndependent = isIndependent && ArePlansIndependent(enemyPlans + i, plan);
+            }
+            if(!isIndependent) break;
+            Entity enemy = combatEnemies[state->waveEnd];
+            if(plan->isInMelee)
+            {
+                ClearQueue(enemy);
+                EnqueueAttack(enemy, player);
+            }
+            else
+            {
+                EnqueueMoves(enemy, plan->path, plan->nbMoves);
+                if(plan->isAttacking) EnqueueAttack(enemy, player);
+                state->pathLength = 0;
+                GAME_LOG(LOG_INFO, LOG_AI, "enemy moving\n");
+            }
+        }
+        gameState = GAME_COMBAT_ENEMYRESOLVE;
+        break;
+    case GAME_COMBAT_ENEMYRESOLVE:
+        // update enemy positions
+        UpdateSprites(deltaTime, &state->rng);
+        // check if the wave is finished
+        bool isWaveDone = true;
+        for(int i = state->currentEnemy; i < state->waveEnd; i++)
+        {
+            isWaveDone = isWaveDone && IsIdle(combatEnemies[i]);
+        }
+        if(isWaveDone)
+        {
+            GAME_LOG(LOG_INFO, LOG_STATE, "enemy finished (%d), ", state->waveEnd - state->currentEnemy);
+            // next enemies
+            state->currentEnemy = state->waveEnd;
+            if(state->currentEnemy >= nbCombatEnemies)
+            {
+                GAME_LOG(LOG_INFO, LOG_STATE, "player turn\n");
+                state->currentEnemy = 0;
+                gameState = GAME_COMBAT_PLAYERINPUT;
+            }
+            else
+            {
+                GAME_LOG(LOG_INFO, LOG_STATE, "next enemy\n");
+                gameState = GAME_COMBAT_ENEMYAI;
+            }    
+        }
+        break;
+    }
+}
+
+// combat simulator: encounters played headless to the end, the player on a fixed policy, to
+// measure how fights go; every encounter has its own seed so the results don't depend on how
+// the encounters are spread over workers
+
+// put the player on a free cell in sight of a random mob, close enough to aggro it
+bool PlaceForEncounter(Rng* rng)
+{
+    for(int attempt = 0; attempt < 64; attempt++)
+    {
+        int i = RngNext(rng) % sprites.count;
+        if(sprites.entity[i] == player) continue;
+        SDL_Point mob = sprites.pos[i];
+        int dx = (int)(RngNext(rng) % (2 * aggroRadius + 1)) - aggroRadius;
+        int dy = (int)(RngNext(rng) % (2 * aggroRadius + 1)) - aggroRadius;
+        SDL_Point p = {mob.x + dx, mob.y + dy};
+        if((p.x < 0) || (p.y < 0) || (p.x >= mapWidth) || (p.y >= mapHeight)) continue;
+        if(IsColliding(p.x, p.y) || (dx * dx + dy * dy > aggroRadius * aggroRadius)) continue;
+        if(!FovIsVisible(GetFov(&fovCache, p, aggroRadius), mob)) continue;
+        MoveSprite(player, p);
+        return true;
+    }
+    return false;
+}
+
+// the simulated player, as readInput for GameTick: attacks the enemy cheapest to reach when one
+// is in reach, else moves as close as it can to the nearest one; the button is released every
+// other tick so that each click is a new press
+Uint32 SimulatedInput(SDL_Point* cursor, void* data)
+{
+    const TickState* state = data;
+    SDL_Point from = SpritePos(player);
+    *cursor = from;
+    if((gameState != GAME_COMBAT_PLAYERINPUT) || state->prevButtons) return 0;
+    RangeUpdate(&playerRange, from);
+    float bestCost = FLT_MAX;
+    int bestDistance = INT_MAX;
+    SDL_Point nearest = from;
+    for(int i = 0; i < nbCombatEnemies; i++)
+    {
+        SDL_Point enemy = SpritePos(combatEnemies[i]);
+        float cost;
+        RangeAttackCell(&playerRange, enemy, &cost);
+        int dx = enemy.x - from.x, dy = enemy.y - from.y;
+        if(cost < bestCost)
+        {
+            bestCost = cost;
+            *cursor = enemy;
+        }
+        if(dx * dx + dy * dy < bestDistance)
+        {
+            bestDistance = dx * dx + dy * dy;
+            nearest = enemy;
+        }
+    }
+    if(bestCost <= playerMaxMove) return SDL_BUTTON_LMASK;
+    // out of reach: the cell in reach closest to the nearest enemy
+    *cursor = from;
+    int reach = (int)playerMaxMove;
+    for(int y = from.y - reach; y <= from.y + reach; y++)
+        for(int x = from.x - reach; x <= from.x + reach; x++)
+        {
+            SDL_Point p = {x, y};
+            int dx = nearest.x - x, dy = nearest.y - y;
+            if((RangeCost(&playerRange, p) > playerMaxMove) || (dx * dx + dy * dy >= bestDistance)) continue;
+            bestDistance = dx * dx + dy * dy;
+            *cursor = p;
+        }
+    return SDL_BUTTON_LMASK;
+}
+
+// play encounter k on a fresh copy of the level, until one side is dead or MAX_SIM_TURNS
+void SimulateEncounter(int k, SimStats* stats)
+{
+    // the copy bypasses SetColliding, so the HPA* graph is marked for a rebuild here; the terrain
+    // never changes, the caches on it stay valid
+    GridCopy(&collision, &simCollision);
+    if(hpa.clusters && (hpa.width == collision.width) && (hpa.height == collision.height))
+    {
+        for(int i = 0; i < hpa.nbClustersX * hpa.nbClustersY; i++)
+        {
+            hpa.clusters[i].isDirty = true;
+        }
+        hpa.isDirty = true;
+    }
+    SpawnLevel(&level);
+    gameState = GAME_EXPLORE;
+    nbCombatEnemies = 0;
+    DStarWatch(&playerPlanner, NULL, 0);
+    TickState state;
+    TickStateInit(&state, seed * 0x100000001B3ull + k);
+    if(!PlaceForEncounter(&state.rng))
+    {
+        stats->nbSkipped++;
+        return;
+    }
+    // no animation to wait for, a move takes a tick
+    const float deltaTime = 1.0f / moveSpeed;
+    GameTick(&state, deltaTime, SimulatedInput, &state);
+    if(nbCombatEnemies == 0)
+    {
+        stats->nbSkipped++;
+        return;
+    }
+    stats->nbEnemies += nbCombatEnemies;
+    int nbTurns = 0;
+    while(true)
+    {
+        if(sprites.hp[EntityIndex(&sprites, player)] <= 0)
+        {
+            stats->turns[SIM_LOSS][nbTurns]++;
+            return;
         }
-        else if(!isVisited[current.x][current.y])
+        if(gameState == GAME_EXPLORE)
         {
-            SDL_Point neighbors[8];
-            int nb_neighbors = GetNeighbors(current, neighbors);
-            for(int i = 0; i < nb_neighbors; i++)
+            stats->turns[SIM_WIN][nbTurns]++;
+            return;
+        }
+        int prevState = gameState;
+        GameTick(&state, deltaTime, SimulatedInput, &state);
+        if((gameState == GAME_COMBAT_PLAYERINPUT) && (prevState != GAME_COMBAT_PLAYERINPUT))
+        {
+            if(nbTurns == MAX_SIM_TURNS)
             {
-                SDL_Point neighbor = neighbors[i];
-                float tentativeDFromStart = dFromStart[current.x][current.y] + MoveCost(current, neighbor);
-                if(tentativeDFromStart < dFromStart[neighbor.x][neighbor.y]) // found a shorter path from start to neighbor
-                {
-                    cameFrom[neighbor.x][neighbor.y] = current;
-                    dFromStart[neighbor.x][neighbor.y] = tentativeDFromStart;
-                    dToGoal[neighbor.x][neighbor.y] = tentativeDFromStart + h(neighbor, end);
-                    HeapInsert(heap, &heapSize, neighbor, dToGoal);
-                }
+                stats->turns[SIM_DRAW][nbTurns]++;
+                return;
             }
-            isVisited[current.x][current.y] = true;
+            nbTurns++;
         }
     }
-    return -1;
 }
 
-bool InMeleeRange(const Sprite* a, const Sprite* b)
+void SimulateShare(int worker, int nbShares, SimStats* stats)
 {
-    return (abs(a->pos.x - b->pos.x) <= 1) && (abs(a->pos.y - b->pos.y) <= 1);
+    for(int k = worker; k < simEncounters; k += nbShares)
+    {
+        SimulateEncounter(k, stats);
+    }
 }
 
-void EnqueueMoves(SDL_Point path[], int len)
+void SimAdd(SimStats* total, const SimStats* share)
 {
-    for(int i = 0; i < len; i++)
-    {
-        actionQueue[actionTail].tp = ACTION_MOVE;
-        actionQueue[actionTail].obj.to = path[i];
-        actionTail++;
-        if(actionTail >= MAX_ACTIONS)
+    for(int i = 0; i < NB_SIM_OUTCOMES; i++)
+        for(int j = 0; j <= MAX_SIM_TURNS; j++)
         {
-            actionTail = 0;
-        }    
-    }
+            total->turns[i][j] += share->turns[i][j];
+        }
+    total->nbEnemies += share->nbEnemies;
+    total->nbSkipped += share->nbSkipped;
 }
 
-void EnqueueAttack(Sprite* target)
+// smallest number of turns at least a fraction q of the encounters took
+int TurnPercentile(const Uint64 turns[], Uint64 count, double q)
 {
-    actionQueue[actionTail].tp = ACTION_ATTACK;
-    actionQueue[actionTail].obj.target = target;
-    actionTail++;
-    if(actionTail >= MAX_ACTIONS)
+    Uint64 sum = 0;
+    for(int i = 0; i < MAX_SIM_TURNS; i++)
     {
-        actionTail = 0;
-    }    
+        sum += turns[i];
+        if(sum >= q * count) return i;
+    }
+    return MAX_SIM_TURNS;
 }
 
-Action DequeueAction()
+void SimReport(const SimStats* stats, int nbProcesses, Uint64 start)
 {
-    Action action = actionQueue[actionHead];
-    actionHead++;
-    if(actionHead >= MAX_ACTIONS)
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    Uint64 counts[NB_SIM_OUTCOMES] = {0};
+    Uint64 nbPlayed = 0;
+    for(int i = 0; i < NB_SIM_OUTCOMES; i++)
     {
-        actionHead = 0;
+        for(int j = 0; j <= MAX_SIM_TURNS; j++)
+        {
+            counts[i] += stats->turns[i][j];
+        }
+        nbPlayed += counts[i];
+    }
+    printf("simulated %llu encounters in %.2fs over %d processes (%.0f/s), %llu skipped, %.2f enemies per fight\n",
+        (unsigned long long)nbPlayed, seconds, nbProcesses, nbPlayed / seconds, (unsigned long long)stats->nbSkipped,
+        nbPlayed ? (double)stats->nbEnemies / nbPlayed : 0.0);
+    if(nbPlayed == 0) return;
+    for(int i = 0; i < NB_SIM_OUTCOMES; i++)
+    {
+        if(counts[i] == 0)
+        {
+            printf("%-5s %6.2f%%\n", outcomeNames[i], 0.0);
+            continue;
+        }
+        Uint64 sum = 0;
+        int max = 0;
+        for(int j = 0; j <= MAX_SIM_TURNS; j++)
+        {
+            sum += j * stats->turns[i][j];
+            if(stats->turns[i][j]) max = j;
+        }
+        printf("%-5s %6.2f%%, turns mean=%.2f p50=%d p90=%d p99=%d max=%d\n", outcomeNames[i], 100.0 * counts[i] / nbPlayed,
+            (double)sum / counts[i], TurnPercentile(stats->turns[i], counts[i], 0.5), 
+            TurnPercentile(stats->turns[i], counts[i], 0.9), TurnPercentile(stats->turns[i], counts[i], 0.99), max);
+    }
+    // turn count distribution of the fights that ended
+    printf("turns    win%%   loss%%\n");
+    for(int j = 0; j < MAX_SIM_TURNS; j++)
+    {
+        if((stats->turns[SIM_WIN][j] == 0) && (stats->turns[SIM_LOSS][j] == 0)) continue;
+        printf("%5d %7.3f %7.3f\n", j, 100.0 * stats->turns[SIM_WIN][j] / nbPlayed, 100.0 * stats->turns[SIM_LOSS][j] / nbPlayed);
     }
-    return action;
 }
 
-bool IsQueueEmpty()
+// play simEncounters encounters over as many processes as the pool would have threads, main one
+// included; the world is global, so each other worker is a fork playing its share on its own
+// copy and sending back its stats through a pipe
+void Simulate()
 {
-    return actionTail == actionHead;
+    LogLevel level = logLevel;
+    logLevel = LOG_NONE;
+    int nbProcesses = ((nbWorkers < 0) ? SDL_GetCPUCount() - 1 : nbWorkers) + 1;
+    nbProcesses = SDL_max(1, SDL_min(nbProcesses, simEncounters));
+    Uint64 start = SDL_GetPerformanceCounter();
+    SimStats total;
+    memset(&total, 0, sizeof(total));
+    GridInit(&simCollision, mapWidth, mapHeight);
+    GridCopy(&simCollision, &collision);
+#ifndef _WIN32
+    int fds[nbProcesses];
+    pid_t pids[nbProcesses];
+    for(int w = 1; w < nbProcesses; w++)
+    {
+        int fd[2];
+        fds[w] = -1;
+        if(pipe(fd) != 0) continue;
+        pids[w] = fork();
+        if(pids[w] == 0)
+        {
+            close(fd[0]);
+            SimStats share;
+            memset(&share, 0, sizeof(share));
+            SimulateShare(w, nbProcesses, &share);
+            bool isWritten = (write(fd[1], &share, sizeof(share)) == sizeof(share));
+            _exit(isWritten ? 0 : 1);
+        }
+        close(fd[1]);
+        if(pids[w] > 0) fds[w] = fd[0];
+        else close(fd[0]);
+    }
+    SimulateShare(0, nbProcesses, &total);
+    for(int w = 1; w < nbProcesses; w++)
+    {
+        if(fds[w] < 0)
+        {
+            SimulateShare(w, nbProcesses, &total); // no process for this share, play it here
+            continue;
+        }
+        SimStats share;
+        size_t size = 0;
+        ssize_t length;
+        while((size < sizeof(share)) && ((length = read(fds[w], (char*)&share + size, sizeof(share) - size)) > 0))
+        {
+            size += length;
+        }
+        close(fds[w]);
+        waitpid(pids[w], NULL, 0);
+        if(size == sizeof(share)) SimAdd(&total, &share);
+        else printf("simulation worker %d failed\n", w);
+    }
+#else
+    nbProcesses = 1;
+    SimulateShare(0, 1, &total);
+#endif
+    GridFree(&simCollision);
+    SimReport(&total, nbProcesses, start);
+    logLevel = level;
 }
 
-void ClearQueue()
+void WatchLevel(LevelWatch* watch)
 {
-    actionHead = actionTail;
-    actionProgress = 0.0f;
+    struct stat st;
+    watch->mtime = (stat(levelFile, &st) == 0) ? st.st_mtime : 0;
+    watch->lastPoll = SDL_GetTicks();
+    watch->fd = -1;
+#ifdef __linux__
+    const char* slash = strrchr(levelFile, '/');
+    char dir[1024];
+    if(slash) snprintf(dir, sizeof(dir), "%.*s", (slash == levelFile) ? 1 : (int)(slash - levelFile), levelFile);
+    else snprintf(dir, sizeof(dir), ".");
+    snprintf(watch->name, sizeof(watch->name), "%s", slash ? slash + 1 : levelFile);
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if((watch->fd >= 0) && (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0))
+    {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+#endif
 }
 
-void AddEnemy(Sprite* sprite)
+void UnwatchLevel(LevelWatch* watch)
 {
-    assert(nbCombatEnemies < MAX_ENEMIES);
-    combatEnemies[nbCombatEnemies] = sprite;
-    nbCombatEnemies++;
+#ifdef __linux__
+    if(watch->fd >= 0) close(watch->fd);
+#endif
+    watch->fd = -1;
 }
 
-void RemoveEnemy(Sprite* sprite)
+// whether the level file was written since the last call
+bool IsLevelChanged(LevelWatch* watch)
 {
-    int i;
-    for(i = 0; i < nbCombatEnemies; i++)
+#ifdef __linux__
+    if(watch->fd >= 0)
     {
-        if(combatEnemies[i] == sprite) break;
+        bool isChanged = false;
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+        while((length = read(watch->fd, buffer, sizeof(buffer))) > 0)
+        {
+            const struct inotify_event* event;
+            for(char* p = buffer; p < buffer + length; p += sizeof(*event) + event->len)
+            {
+                event = (const struct inotify_event*)p;
+                if((event->len > 0) && (strcmp(event->name, watch->name) == 0)) isChanged = true;
+            }
+        }
+        return isChanged;
     }
-    memmove(&combatEnemies[i], &combatEnemies[i + 1], (nbCombatEnemies - i - 1) * sizeof(combatEnemies[0]));
-    nbCombatEnemies--;
+#endif
+    if(SDL_GetTicks() - watch->lastPoll < levelPollPeriod) return false;
+    watch->lastPoll = SDL_GetTicks();
+    struct stat st;
+    if((stat(levelFile, &st) != 0) || (st.st_mtime == watch->mtime)) return false;
+    watch->mtime = st.st_mtime;
+    return true;
 }
 
-void RemoveMob(Sprite* sprite)
+// grow the rect of changed cells of the baked chunk over cell p, if it is baked
+void MarkChunkDirty(SDL_Rect dirty[MAX_CHUNKS], SDL_Point p)
 {
-    isColliding[sprite->pos.x][sprite->pos.y] = false;
-    int mobIdx = (sprite - &mobs[0]) / sizeof(mobs[0]);
-    memmove(sprite, sprite + 1, (nbMobs - mobIdx - 1) * sizeof(mobs[0]));
-    nbMobs--;
+    for(int i = 0; i < MAX_CHUNKS; i++)
+    {
+        if(!chunks[i].isLoaded || (chunks[i].pos.x != p.x / CHUNK_SIZE) || (chunks[i].pos.y != p.y / CHUNK_SIZE)) continue;
+        if(dirty[i].w == 0)
+        {
+            dirty[i] = (SDL_Rect){p.x, p.y, 1, 1};
+            return;
+        }
+        int x0 = SDL_min(dirty[i].x, p.x);
+        int y0 = SDL_min(dirty[i].y, p.y);
+        int x1 = SDL_max(dirty[i].x + dirty[i].w, p.x + 1);
+        int y1 = SDL_max(dirty[i].y + dirty[i].h, p.y + 1);
+        dirty[i] = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+        return;
+    }
 }
 
-void UpdateSprite(Sprite* sprite, float deltaTime)
+// read the level file again and patch the game with what changed in it, tile by tile: collision,
+// mobs and items at changed spawns, and the baked chunks under changed tiles; a level of another
+// size is set up from scratch. Outside combat only, no mob it removes is a combat enemy
+bool ReloadLevel()
 {
-    switch (currentAction.tp)
+    LevelData next;
+    if(!ReadLevel(&next, true)) return false;
+    if((next.header->width != (Uint32)mapWidth) || (next.header->height != (Uint32)mapHeight))
     {
-    case ACTION_NONE:
-        // start next action in the queue if there is one
-        if(!IsQueueEmpty())
-        {
-            currentAction = DequeueAction();
-            actionProgress = 0.0f;
-        }
-        break;
-    case ACTION_MOVE:
-        // progress the move
-        actionProgress += moveSpeed * deltaTime;
-        // if finished, update grid position, and move to next action if any
-        if(actionProgress >= 1.0f)
+        FreeLevel();
+        level = next;
+        ApplyLevel(&level);
+        GAME_LOG(LOG_INFO, LOG_STATE, "level reloaded\n");
+        return true;
+    }
+    ClearQueue(player); // its path may run into new walls
+    SDL_Point playerPos = SpritePos(player);
+    SDL_Rect dirty[MAX_CHUNKS];
+    memset(dirty, 0, sizeof(dirty));
+    int nbChanged = 0;
+    for(int y = 0; y < mapHeight; y++)
+        for(int x = 0; x < mapWidth; x++)
         {
-            isColliding[sprite->pos.x][sprite->pos.y] = false; // update collision grid
-            sprite->pos = currentAction.obj.to;
-            isColliding[sprite->pos.x][sprite->pos.y] = true;
-            if(IsQueueEmpty())
+            int cell = y * mapWidth + x;
+            SDL_Point p = {x, y};
+            bool isChanged = false;
+            for(int i = 0; i < NB_LAYERS; i++)
             {
-                currentAction.tp = ACTION_NONE;
-                actionProgress = 0.0f;
+                isChanged = isChanged || (next.layers[i][cell] != layerData[i][cell]);
             }
-            else
+            if(!isChanged) continue;
+            nbChanged++;
+            const int bakedLayers[] = {LAYER_GROUND, LAYER_WALLS, LAYER_PROPS, LAYER_TOP};
+            for(int i = 0; i < 4; i++)
             {
-                currentAction = DequeueAction();
-                if(currentAction.tp == ACTION_MOVE)
-                {
-                    actionProgress -= 1.0f; // roll extra progress into next move
-                }
-                else
+                if(next.layers[bakedLayers[i]][cell] != layerData[bakedLayers[i]][cell]) MarkChunkDirty(dirty, p);
+            }
+            // the mob leaves before the collision changes, a new one spawns after, walls or not, as
+            // when the level is loaded
+            bool isMobChanged = (next.layers[LAYER_MOBS][cell] != layerData[LAYER_MOBS][cell]);
+            Entity mob = EnemyAtPosition(p);
+            if(isMobChanged && (layerData[LAYER_MOBS][cell] == SPRITE_ORC) && mob) RemoveMob(mob);
+            if(next.layers[LAYER_COLLISION][cell] != layerData[LAYER_COLLISION][cell])
+            {
+                bool isBlocking = next.layers[LAYER_COLLISION][cell] > 0;
+                bool isOccupied = (mobIndex.cells[cell] >= 0) || ((playerPos.x == x) && (playerPos.y == y));
+                GridSet(&terrain, x, y, isBlocking);
+                SetColliding(x, y, isBlocking || isOccupied);
+            }
+            bool isFree = (mobIndex.cells[cell] < 0) && ((playerPos.x != x) || (playerPos.y != y));
+            if(isMobChanged && (next.layers[LAYER_MOBS][cell] == SPRITE_ORC) && isFree)
+            {
+                IndexInsert(SpriteInit(&sprites, x, y, SPRITE_ORC, true));
+            }
+            if(next.layers[LAYER_ITEMS][cell] != layerData[LAYER_ITEMS][cell])
+            {
+                for(int i = 0; i < items.count; i++)
                 {
-                    actionProgress = 0.0f;
+                    if((items.pos[i].x != x) || (items.pos[i].y != y)) continue;
+                    DestroyEntity(&items, items.entity[i]);
+                    break;
                 }
+                if(next.layers[LAYER_ITEMS][cell] > 0) SpriteInit(&items, x, y, next.layers[LAYER_ITEMS][cell], false);
             }
         }
-        // update display position
-        sprite->offset.x = (currentAction.obj.to.x - sprite->pos.x) * actionProgress * gridSize;
-        sprite->offset.y = (currentAction.obj.to.y - sprite->pos.y) * actionProgress * gridSize - 16;
-        break;
-    case ACTION_ATTACK:
+    CloseLevel(&level);
+    level = next;
+    for(int i = 0; i < NB_LAYERS; i++)
     {
-        Sprite* target = currentAction.obj.target;
-        // attack
-        int attackRoll = (rand() % 20) + 1;
-        printf("attack roll=%d, ", attackRoll);
-        if(attackRoll >= target->AC)
-        {
-            printf("hit, ");
-            int dmgRoll = (rand() % 6) + 1;
-            printf("dmg=%d, ", dmgRoll);
-            target->hp -= dmgRoll;
-            printf("hp=%d, \n", target->hp);
-            if(target->hp <= 0)
-            {
-                if(target != &player)
-                {
-                    RemoveEnemy(target);
-                    RemoveMob(target);
-                }
+        layerData[i] = level.layers[i];
+    }
+    BakeJob jobs[MAX_CHUNKS];
+    int nbJobs = 0;
+    for(int i = 0; i < MAX_CHUNKS; i++)
+    {
+        BakeJob job = {chunks + i, dirty[i], NULL, NULL};
+        if(dirty[i].w > 0) jobs[nbJobs++] = job;
+    }
+    BakeChunks(jobs, nbJobs);
+    GAME_LOG(LOG_INFO, LOG_STATE, "level reloaded, %d cells changed\n", nbChanged);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    // parse command line
+
+    const char* convertFile = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--headless") == 0)
+        {
+            headless = true;
+        }
+        else if((strcmp(argv[i], "--bench") == 0) && (i + 1 < argc))
+        {
+            benchTicks = atoi(argv[++i]);
+        }
+        else if((strcmp(argv[i], "--simulate") == 0) && (i + 1 < argc))
+        {
+            simEncounters = atoi(argv[++i]);
+        }
+        else if((strcmp(argv[i], "--level") == 0) && (i + 1 < argc))
+        {
+            levelFile = argv[++i];
+        }
+        else if((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+        {
+            nbWorkers = atoi(argv[++i]);
+        }
+        else if((strcmp(argv[i], "--seed") == 0) && (i + 1 < argc))
+        {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--range") == 0)
+        {
+            showRange = true;
+        }
+        else if((strcmp(argv[i], "--profile") == 0) && (i + 1 < argc))
+        {
+            profileFile = argv[++i];
+        }
+        else if((strcmp(argv[i], "--log") == 0) && (i + 1 < argc))
+        {
+            logFile = argv[++i];
+        }
+        else if((strcmp(argv[i], "--log-level") == 0) && (i + 1 < argc) && (LogLevelFromName(argv[i + 1]) >= 0))
+        {
+            logLevel = LogLevelFromName(argv[++i]);
+        }
+        else if((strcmp(argv[i], "--log-categories") == 0) && (i + 1 < argc))
+        {
+            i++;
+            logCategories = 0;
+            for(int j = 0; j < NB_LOG_CATEGORIES; j++)
+            {
+                if(strstr(argv[i], logCategoryNames[j])) logCategories |= 1 << j;
             }
         }
+        else if((strcmp(argv[i], "--record") == 0) && (i + 1 < argc))
+        {
+            recordFile = argv[++i];
+        }
+        else if((strcmp(argv[i], "--replay") == 0) && (i + 1 < argc))
+        {
+            replayFile = argv[++i];
+        }
+        else if((strcmp(argv[i], "--fps") == 0) && (i + 1 < argc))
+        {
+            maxFps = atoi(argv[++i]);
+        }
+        else if((strcmp(argv[i], "--convert") == 0) && (i + 1 < argc))
+        {
+            convertFile = argv[++i];
+        }
+        else if((strcmp(argv[i], "--path") == 0) && (i + 1 < argc) && (strcmp(argv[i + 1], "astar") == 0))
+        {
+            pathMode = PATH_ASTAR;
+            i++;
+        }
+        else if((strcmp(argv[i], "--path") == 0) && (i + 1 < argc) && (strcmp(argv[i + 1], "jps") == 0))
+        {
+            pathMode = PATH_JPS;
+            i++;
+        }
+        else if((strcmp(argv[i], "--path") == 0) && (i + 1 < argc) && (strcmp(argv[i + 1], "hpa") == 0))
+        {
+            pathMode = PATH_HPA;
+            i++;
+        }
         else
         {
-            printf("miss\n");
+            printf("usage: %s [--headless] [--bench ticks] [--simulate n] [--level file] [--path astar|jps|hpa] [--threads n] [--fps n] [--range] [--seed n] [--profile file] [--log file] [--log-level debug|info|warning|error|none] [--log-categories combat,ai,state] [--record file] [--replay file] [--convert file]\n", argv[0]);
+            return 1;
         }
-        currentAction.tp = ACTION_NONE;
-        actionProgress = 0.0f;
-        break;
     }
+
+    // compile the level to a binary level file and stop there
+
+    if(convertFile)
+    {
+        size_t size;
+        void* image = CompileLevel(levelFile, &size);
+        bool isWritten = image && WriteLevel(convertFile, image, size);
+        free(image);
+        if(!isWritten)
+        {
+            printf("Can't convert %s to %s\n", levelFile, convertFile);
+            return 1;
+        }
+        return 0;
     }
-}
 
-float SpriteDistance(const Sprite* a, const Sprite* b)
-{
-    float dx = a->pos.x - b->pos.x;
-    float dy = a->pos.y - b->pos.y;
-    return sqrtf(dx * dx + dy * dy);
-}
+    // play combat encounters headless for their statistics and stop there
 
-float PathMoveCost(SDL_Point path[], int pathLength)
-{
-    float cost = 0.0f;
-    for(int i = 1; i < pathLength - 1; i++)
+    if(simEncounters > 0)
     {
-        cost += MoveCost(path[i - 1], path[i]);
+        if(!LoadLualevel())
+        {
+            printf("Can't load level\n");
+            return 1;
+        }
+        Simulate();
+        FreeLevel();
+        return 0;
     }
-    return cost;
-}
 
-Sprite* EnemyAtPosition(SDL_Point p)
-{
-    for(int i = 0; i < nbMobs; i++)
+    // replays play the recorded level and seed, headless and as fast as possible
+
+    if(replayFile)
     {
-        if((p.x == mobs[i].pos.x) && (p.y == mobs[i].pos.y))
+        if(!ReplayOpen(replayFile))
         {
-            return mobs + i;
+            printf("Can't replay %s\n", replayFile);
+            return 1;
         }
+        levelFile = recording.header.levelFile;
+        seed = recording.header.seed;
+        headless = true;
+    }
+    if(recordFile && !RecordOpen(recordFile, seed))
+    {
+        printf("Can't record to %s\n", recordFile);
+        return 1;
     }
-    return NULL;
-}
 
-int main(int argc, char* argv[])
-{
     // initialize SDL and graphic resources
 
-    if (SDL_Init(SDL_INIT_EVERYTHING) != 0) 
+    if (SDL_Init(headless ? (SDL_INIT_TIMER | SDL_INIT_EVENTS) : SDL_INIT_EVERYTHING) != 0) 
     {
         SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
         return 1;
     }
-    SDL_Window* window = SDL_CreateWindow(
-        "title", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 
-        viewColumns * gridSize * scaling, viewRows * gridSize * scaling, SDL_WINDOW_SHOWN);
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if(!LogInit())
+    {
+        printf("Can't log to %s\n", logFile);
+        return 1;
+    }
+    ThreadPoolInit((nbWorkers < 0) ? SDL_GetCPUCount() - 1 : nbWorkers);
+    SDL_Window* window = NULL;
+    if(!headless)
+    {
+        window = SDL_CreateWindow(
+            "title", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 
+            viewColumns * gridSize * scaling, viewRows * gridSize * scaling, SDL_WINDOW_SHOWN);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
-    // load sprite sheet in graphic memory
+        // load sprite sheet in graphic memory
+
+        IMG_Init(IMG_INIT_PNG);
+        SDL_Surface* image = IMG_Load(spriteSheetFile);
+        if(!image) {
+            printf("IMG_Load: %s\n", IMG_GetError());
+            // handle error
+        }
+        spriteSheetTexture = SDL_CreateTextureFromSurface(renderer, image);
+        SDL_Surface* sheet = image ? SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_RGBA8888, 0) : NULL;
+        if(sheet && (SDL_LockSurface(sheet) == 0))
+        {
+            sheetWidth = sheet->w;
+            sheetHeight = sheet->h;
+            sheetPixels = malloc(sheetWidth * sheetHeight * sizeof(sheetPixels[0]));
+            assert(sheetPixels);
+            for(int y = 0; y < sheetHeight; y++)
+            {
+                memcpy(sheetPixels + y * sheetWidth, (Uint8*)sheet->pixels + y * sheet->pitch, sheetWidth * sizeof(sheetPixels[0]));
+            }
+            SDL_UnlockSurface(sheet);
+        }
+        SDL_FreeSurface(sheet);
+        SDL_FreeSurface(image);
+        IMG_Quit();
 
-    IMG_Init(IMG_INIT_PNG);
-    SDL_Surface* image = IMG_Load(spriteSheetFile);
-    if(!image) {
-        printf("IMG_Load: %s\n", IMG_GetError());
-        // handle error
+        SDL_RendererInfo info;
+        if((maxFps < 0) && (SDL_GetRendererInfo(renderer, &info) == 0))
+        {
+            maxFps = (info.flags & SDL_RENDERER_PRESENTVSYNC) ? 0 : 60;
+        }
     }
-    spriteSheetTexture = SDL_CreateTextureFromSurface(renderer, image);
-    SDL_FreeSurface(image);
-    IMG_Quit();
 
     // load level
 
@@ -721,257 +5033,228 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if(!headless) WatchLevel(&levelWatch);
+    bool isLevelStale = false; // written since loaded, reloaded when out of combat
+
     // other initialization
     SDL_Rect camera = {
-        gridSize * (player.pos.x - viewColumns / 2), 
-        gridSize * (player.pos.y - viewRows / 2), 
+        gridSize * (SpritePos(player).x - viewColumns / 2), 
+        gridSize * (SpritePos(player).y - viewRows / 2), 
         gridSize * viewColumns, 
         gridSize * viewRows};
-    SDL_Point cursor = {0, 0};
-    int cursorSpriteIndex = SPRITE_MOVETO;
-    Uint32 prevButtons = 0;
-    SDL_Point path[MAX_PATH];
-    int pathLength = 0;
-    int currentTime = 0;
-    int prevTime = 0;
-    float deltaTime;
-    float frameTime = 0.0f;
-    int currentEnemy = 0;
+    Uint64 prevCounter = SDL_GetPerformanceCounter();
+    double lag = 0.0; // in seconds, time not yet simulated
+    Uint64 benchStart = SDL_GetPerformanceCounter();
+    TickState state;
+    TickStateInit(&state, seed);
+    SceneState drawnScene;
+    bool isSceneDirty = true; // set when the window needs drawing whatever the scene
+    bool isIdle = false;
 
-    SDL_RenderSetScale(renderer, scaling, scaling);
-    SDL_RenderPresent(renderer);
+    if(renderer)
+    {
+        SDL_RenderSetScale(renderer, scaling, scaling);
+        SDL_RenderPresent(renderer);
+    }
 
     // main game loop
 
     SDL_bool loopShouldStop = SDL_FALSE;
     while (!loopShouldStop)
     {
-        prevTime = currentTime;
-        currentTime = SDL_GetTicks();
-        deltaTime = (currentTime - prevTime) / 1000.0f;
-
+        // when the last frame changed nothing, sleep until there is an event to react to
         SDL_Event event;
-        while (SDL_PollEvent(&event))
+        bool hasEvent = isIdle ? SDL_WaitEventTimeout(&event, idleTimeout) : SDL_PollEvent(&event);
+        PROFILE_BEGIN(ZONE_INPUT);
+        while (hasEvent)
         {
             switch (event.type)
             {
                 case SDL_QUIT:
                     loopShouldStop = SDL_TRUE;
                     break;
-            }
-        }
-
-        frameTime += deltaTime;
-        if(frameTime >= 0.04f)
-        {
-            Sprite* enemy = combatEnemies[currentEnemy];
-            Sprite* target = NULL;
-            int x, y;
-            Uint32 buttons;
-            switch (gameState)
-            {
-            case GAME_EXPLORE:
-                // update cursor
-                SDL_PumpEvents();
-                buttons = SDL_GetMouseState(&x, &y);
-                cursor.x = (x / (int)scaling + camera.x) / gridSize;
-                cursor.y = (y / (int)scaling + camera.y) / gridSize;
-                target = EnemyAtPosition(cursor);
-                if(target)
-                {
-                    cursorSpriteIndex = SPRITE_ATTACK;
-                    pathLength = FindPath(player.pos, cursor, path, MeleeDistEstimate);
-                }
-                else
-                {
-                    cursorSpriteIndex = SPRITE_MOVETO;
-                    pathLength = FindPath(player.pos, cursor, path, MoveCost);
-                }
-                if(((buttons & SDL_BUTTON_LMASK) != 0) && ((prevButtons & SDL_BUTTON_LMASK) == 0))
-                {
-                    ClearQueue();
-                    EnqueueMoves(path, pathLength);
-                }
-                prevButtons = buttons;
-                // update player position
-                UpdateSprite(&player, deltaTime);
-                // check aggro
-                for(int i = 0; i < nbMobs; i++)
-                {
-                    if(SpriteDistance(&player, mobs + i) <= aggroRadius) // aggro
-                    {
-                        AddEnemy(mobs + i);
-                    }
-                }
-                // if aggro'd start combat
-                if(nbCombatEnemies > 0) 
-                {
-                    ClearQueue();
-                    printf("combat start, roll initiative\n");
-                    currentEnemy = 0;
-                    // roll initiative
-                    if(rand() % 2)
-                    {
-                        printf("player has initiative\n");
-                        gameState = GAME_COMBAT_PLAYERINPUT;
-                    }
-                    else
-                    {
-                        printf("enemy has initiative\n");
-                        gameState = GAME_COMBAT_ENEMYAI;
-                    }
-                }
-                break;
-            case GAME_COMBAT_PLAYERINPUT:
-                // update cursor
-                SDL_PumpEvents();
-                buttons = SDL_GetMouseState(&x, &y);
-                cursor.x = (x / (int)scaling + camera.x) / gridSize;
-                cursor.y = (y / (int)scaling + camera.y) / gridSize;
-                target = EnemyAtPosition(cursor);
-                if(target)
-                {
-                    pathLength = FindPath(player.pos, cursor, path, MeleeDistEstimate);
-                    if(PathMoveCost(path, pathLength) > playerMaxMove)
-                    {
-                        cursorSpriteIndex = SPRITE_INACCESSIBLE;
-                    }
-                    else
-                    {
-                        cursorSpriteIndex = SPRITE_ATTACK;
-                    }
-                }
-                else
-                {
-                    pathLength = FindPath(player.pos, cursor, path, MoveCost);
-                    if(PathMoveCost(path, pathLength) > playerMaxMove)
-                    {
-                        cursorSpriteIndex = SPRITE_INACCESSIBLE;
-                    }
-                    else
-                    {
-                        cursorSpriteIndex = SPRITE_MOVETO;
-                    }
-                }
-                if(((buttons & SDL_BUTTON_LMASK) != 0) && ((prevButtons & SDL_BUTTON_LMASK) == 0))
-                {
-                    ClearQueue();
-                    EnqueueMoves(path, pathLength);
-                    if(cursorSpriteIndex == SPRITE_ATTACK)
-                    {
-                        EnqueueAttack(target);
-                    }
-                    gameState = GAME_COMBAT_PLAYERRESOLVE;
-                }
-                prevButtons = buttons;
-                break;
-            case GAME_COMBAT_PLAYERRESOLVE:
-                // update player position
-                UpdateSprite(&player, deltaTime);
-                // check if move is finished
-                if(currentAction.tp == ACTION_NONE)
-                {
-                    printf("player finished, ");
-                    if(nbCombatEnemies > 0)
-                    {
-                        printf("enemy turn\n");
-                        gameState = GAME_COMBAT_ENEMYAI;
-                    }
-                    else
-                    {
-                        printf("combat finished\n");
-                        gameState = GAME_EXPLORE;
-                    }
-                }
-                break;
-            case GAME_COMBAT_ENEMYAI:
-                // play enemy turn 
-                if(InMeleeRange(&player, enemy))
-                {
-                    ClearQueue();
-                    EnqueueAttack(&player);
-                }
-                else
-                {
-                    // move within melee range
-                    pathLength = FindPath(enemy->pos, player.pos, path, MeleeDistEstimate);
-                    if(pathLength > enemyMaxMove)
-                    {
-                        EnqueueMoves(path, enemyMaxMove);
-                    }
-                    else
+                case SDL_WINDOWEVENT:
+                    isSceneDirty = true;
+                    break;
+                case SDL_KEYDOWN:
+                    if(event.key.keysym.sym == SDLK_F1)
                     {
-                        EnqueueMoves(path, pathLength);
-                        EnqueueAttack(&player);
+                        showRange = !showRange;
+                        isSceneDirty = true;
                     }
-                    pathLength = 0;
-                    printf("enemy moving\n");
-                }
-                gameState = GAME_COMBAT_ENEMYRESOLVE;
-                break;
-            case GAME_COMBAT_ENEMYRESOLVE:
-                // update enemy position
-                UpdateSprite(enemy, deltaTime);
-                // check if turn is finished
-                if(currentAction.tp == ACTION_NONE)
-                {
-                    printf("enemy finished, ");
-                    // next enemy
-                    currentEnemy++;
-                    if(currentEnemy >= nbCombatEnemies)
+                    else if(event.key.keysym.sym == SDLK_F12)
                     {
-                        printf("player turn\n");
-                        currentEnemy = 0;
-                        gameState = GAME_COMBAT_PLAYERINPUT;
+                        // profile on demand: timings of the last events, and their trace
+                        const char* file = profileFile ? profileFile : "profile.json";
+                        ProfileReport();
+                        if(ProfileDump(file)) printf("profile written to %s\n", file);
                     }
-                    else
-                    {
-                        printf("next enemy\n");
-                        gameState = GAME_COMBAT_ENEMYAI;
-                    }    
-                }
-                break;
+                    break;
             }
+            hasEvent = SDL_PollEvent(&event);
         }
+        PROFILE_END(ZONE_INPUT);
 
-        // re-center camera on player
-        camera.x = gridSize * (player.pos.x - viewColumns / 2) + player.offset.x;
-        camera.y = gridSize * (player.pos.y - viewRows / 2) + player.offset.y;
-        // first render the background
-        SDL_RenderCopy(renderer, backgroundTexture, &camera, NULL);
-        // render sprites
-        RenderSprite(renderer, spriteSheetTexture, &player, &camera);
-        for(int i = 0; i < nbMobs; i++)
+        // pick up edits of the level file between fights
+        if(!headless && IsLevelChanged(&levelWatch)) isLevelStale = true;
+        if(isLevelStale && (gameState == GAME_EXPLORE))
         {
-            RenderSprite(renderer, spriteSheetTexture, mobs + i, &camera);
+            PROFILE_BEGIN(ZONE_RELOAD);
+            if(!ReloadLevel()) GAME_LOG(LOG_ERROR, LOG_STATE, "Can't reload level\n");
+            PROFILE_END(ZONE_RELOAD);
+            isLevelStale = false;
+            isSceneDirty = true;
         }
-        for(int i = 0; i < nbItems; i++)
+
+        // run the game ticks the elapsed time covers, at most maxCatchUpTicks of them
+        Uint64 frameStart = SDL_GetPerformanceCounter();
+        PROFILE_BEGIN(ZONE_FRAME);
+        if(headless)
+        {
+            // simulated clock: one game tick per iteration, as fast as possible
+            lag = tickTime;
+        }
+        else
         {
-            RenderSprite(renderer, spriteSheetTexture, items + i, &camera);
+            lag += (double)(frameStart - prevCounter) / SDL_GetPerformanceFrequency();
+            lag = SDL_min(lag, maxCatchUpTicks * tickTime);
         }
-        // render foreground
-        SDL_RenderCopy(renderer, foregroundTexture, &camera, NULL);
-        // draw cursor
-        SDL_Rect dstrect = {cursor.x * gridSize - camera.x, cursor.y * gridSize - camera.y, gridSize, gridSize};
-        RenderSpriteIndex(renderer, spriteSheetTexture, cursorSpriteIndex, &dstrect);
-        // draw path
-        for(int i = 1; i < pathLength - 1; i++)
+        prevCounter = frameStart;
+        while(lag >= tickTime)
         {
-            dstrect.x = path[i].x * gridSize - camera.x;
-            dstrect.y = path[i].y * gridSize - camera.y;
-            RenderSpriteIndex(renderer, spriteSheetTexture, SPRITE_PATHDOT, &dstrect);
+            lag -= tickTime;
+            PROFILE_BEGIN(ZONE_TICK);
+            GameTick(&state, tickTime, ReadPlayerInput, &camera);
+            Checkpoint(&state.rng);
+            tick++;
+            PROFILE_END(ZONE_TICK);
         }
 
-        SDL_RenderPresent(renderer);
+        // re-center camera on player, drawn in between the last two ticks
+        float alpha = lag / tickTime;
+        int playerIndex = EntityIndex(&sprites, player);
+        SDL_Point playerDrawPos = InterpolatedDrawPos(&sprites, playerIndex, alpha);
+        camera.x = playerDrawPos.x - gridSize * (viewColumns / 2);
+        camera.y = playerDrawPos.y - gridSize * (viewRows / 2);
+
+        // idle once the frame would come out as the last one drawn, and nothing is in motion
+        SceneState scene = {camera, state.cursor, state.cursorSpriteIndex, state.pathLength, collision.version, items.count};
+        bool isAnimating = (gameState != GAME_EXPLORE) && (gameState != GAME_COMBAT_PLAYERINPUT);
+        isAnimating = isAnimating || !IsIdle(player) || (sprites.prevDrawTick[playerIndex] == tick - 1);
+        isIdle = renderer && !isSceneDirty && !isAnimating && (memcmp(&scene, &drawnScene, sizeof(scene)) == 0);
+
+        if(renderer && !isIdle)
+        {
+            drawnScene = scene;
+            isSceneDirty = false;
+            // first render the background
+            PROFILE_BEGIN(ZONE_BACKGROUND);
+            StreamChunks(&camera);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            RenderChunks(&camera, false);
+            if(showRange && (gameState == GAME_COMBAT_PLAYERINPUT))
+            {
+                // the cells the player can reach this turn, tinted
+                SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+                SDL_SetRenderDrawColor(renderer, 64, 160, 255, 80);
+                int reach = (int)playerMaxMove;
+                for(int y = playerRange.origin.y - reach; y <= playerRange.origin.y + reach; y++)
+                    for(int x = playerRange.origin.x - reach; x <= playerRange.origin.x + reach; x++)
+                    {
+                        SDL_Point p = {x, y};
+                        if(RangeCost(&playerRange, p) == FLT_MAX) continue;
+                        SDL_Rect rect = {x * gridSize - camera.x, y * gridSize - camera.y, gridSize, gridSize};
+                        SDL_RenderFillRect(renderer, &rect);
+                    }
+            }
+            PROFILE_END(ZONE_BACKGROUND);
+            // render sprites, batched and culled against the view
+            PROFILE_BEGIN(ZONE_SPRITES);
+            SDL_Rect view = {0, 0, camera.w, camera.h};
+            BatchBegin(&spriteBatch, spriteSheetTexture, &view);
+            BatchStoreSprite(&spriteBatch, &sprites, playerIndex, alpha, &camera);
+            BatchMobs(&spriteBatch, alpha, &camera);
+            for(int i = 0; i < items.count; i++)
+            {
+                BatchStoreSprite(&spriteBatch, &items, i, alpha, &camera);
+            }
+            BatchFlush(renderer, &spriteBatch);
+            PROFILE_END(ZONE_SPRITES);
+            // render foreground
+            PROFILE_BEGIN(ZONE_FOREGROUND);
+            RenderChunks(&camera, true);
+            // draw cursor
+            SDL_Rect dstrect = {state.cursor.x * gridSize - camera.x, state.cursor.y * gridSize - camera.y, gridSize, gridSize};
+            BatchSprite(&spriteBatch, state.cursorSpriteIndex, &dstrect);
+            // draw path
+            for(int i = 1; i < state.pathLength - 1; i++)
+            {
+                dstrect.x = state.path[i].x * gridSize - camera.x;
+                dstrect.y = state.path[i].y * gridSize - camera.y;
+                BatchSprite(&spriteBatch, SPRITE_PATHDOT, &dstrect);
+            }
+            BatchFlush(renderer, &spriteBatch);
+            PROFILE_END(ZONE_FOREGROUND);
+
+            PROFILE_BEGIN(ZONE_PRESENT);
+            SDL_RenderPresent(renderer);
+            PROFILE_END(ZONE_PRESENT);
+            if(maxFps > 0)
+            {
+                Uint64 frameTicks = SDL_GetPerformanceFrequency() / maxFps;
+                Uint64 elapsed = SDL_GetPerformanceCounter() - frameStart;
+                if(elapsed < frameTicks) SDL_Delay((frameTicks - elapsed) * 1000 / SDL_GetPerformanceFrequency());
+            }
+        }
+        PROFILE_END(ZONE_FRAME);
+        BenchRecord(&benchFrame, frameStart);
+        if((benchTicks > 0) && (tick >= benchTicks)) loopShouldStop = SDL_TRUE;
+        if(IsReplaying() && (tick >= recording.endTick)) loopShouldStop = SDL_TRUE;
+    }
+    LogFree(); // what the game logged comes before the reports
+
+    if(benchTicks > 0)
+    {
+        printf("bench: %d ticks in %.3fs\n", tick, 
+            (SDL_GetPerformanceCounter() - benchStart) / (double)SDL_GetPerformanceFrequency());
+        BenchReport(&benchFrame);
+        BenchReport(&benchFindPath);
+        BenchReport(&benchUpdateSprite);
+        BenchReport(&benchEnemyPlan);
+        printf("path cache     hits=%d misses=%d\n", pathCache.hits, pathCache.misses);
+        printf("fov cache      hits=%d misses=%d\n", fovCache.hits, fovCache.misses);
+    }
+    if(profileFile)
+    {
+        ProfileReport();
+        if(!ProfileDump(profileFile)) printf("Can't write profile %s\n", profileFile);
     }
 
     // clean-up
+    PathContextFree(&pathContext);
+    PathContextFree(&meleeField.ctx);
+    PathContextFree(&playerRange.ctx);
+    FovCacheFree(&fovCache);
+    DStarFree(&playerPlanner);
+    for(int i = 0; i <= MAX_WORKERS; i++)
+    {
+        PathContextFree(workerContexts + i);
+    }
+    ThreadPoolFree();
+    ProfileFree();
+    UnwatchLevel(&levelWatch);
+    HpaFree();
     SDL_DestroyTexture(spriteSheetTexture);
-    SDL_DestroyTexture(backgroundTexture);
-    SDL_DestroyTexture(foregroundTexture);
+    free(sheetPixels);
+    BatchFree(&spriteBatch);
+    FreeChunks();
+    FreeLevel();
+    StoreFree(&sprites);
+    StoreFree(&items);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
-    return 0;
+    return RecordClose() ? 0 : 1;
 }
\ No newline at end of file